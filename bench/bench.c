@@ -0,0 +1,378 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+/*
+ * Microbenchmarks of the library hot paths.
+ *
+ * Prints one JSON object per line: benchmark name, parameters, iterations, nanoseconds per operation and heap
+ * allocations per operation. Run all benchmarks, or only those whose name contains the first argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../shared/railcan-proto/railcan_proto.h"
+#include "librailcan.h"
+#include "bus.h"
+#include "module.h"
+#include "module_dcc.h"
+#include "module_dcc_packet.h"
+#include "module_io.h"
+#include "socketcan.h"
+
+#define BENCH_MIN_TIME_NS  200000000ULL //!< Minimum measured run time per benchmark.
+
+/*
+ * Allocation counting, interposes the allocator and forwards to glibc.
+ */
+
+extern void* __libc_malloc( size_t size );
+extern void* __libc_calloc( size_t count , size_t size );
+extern void* __libc_realloc( void* ptr , size_t size );
+extern void __libc_free( void* ptr );
+
+static size_t allocations;
+
+void* malloc( size_t size )
+{
+  allocations++;
+  return __libc_malloc( size );
+}
+
+void* calloc( size_t count , size_t size )
+{
+  allocations++;
+  return __libc_calloc( count , size );
+}
+
+void* realloc( void* ptr , size_t size )
+{
+  allocations++;
+  return __libc_realloc( ptr , size );
+}
+
+void free( void* ptr )
+{
+  __libc_free( ptr );
+}
+
+/*
+ * Harness
+ */
+
+typedef void(*bench_function)( void* context , size_t iterations );
+
+static const char* filter;
+
+static uint64_t now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC , &ts );
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run( const char* name , const char* params , bench_function function , void* context )
+{
+  if( filter && !strstr( name , filter ) )
+    return;
+
+  size_t iterations = 1000;
+  uint64_t elapsed;
+  size_t allocated;
+
+  function( context , iterations ); // warm up
+
+  for( ;; )
+  {
+    allocations = 0;
+    const uint64_t start = now();
+    function( context , iterations );
+    elapsed = now() - start;
+    allocated = allocations;
+
+    if( elapsed >= BENCH_MIN_TIME_NS )
+      break;
+
+    iterations *= ( elapsed < BENCH_MIN_TIME_NS / 16 ) ? 16 : 2;
+  }
+
+  printf( "{\"benchmark\":\"%s\",\"params\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.4f}\n" ,
+    name , params , iterations , (double)elapsed / iterations , (double)allocated / iterations );
+  fflush( stdout );
+}
+
+/*
+ * Fixtures
+ */
+
+static int send_discard( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
+{
+  (void)bus;
+  (void)id;
+  (void)dlc;
+  (void)data;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static struct librailcan_bus* open_bus( void )
+{
+  struct librailcan_bus* bus;
+
+  if( librailcan_bus_open_custom( send_discard , &bus ) != LIBRAILCAN_STATUS_SUCCESS )
+    exit( EXIT_FAILURE );
+
+  return bus;
+}
+
+static struct librailcan_module* add_module( struct librailcan_bus* bus , uint8_t address , uint8_t type , uint8_t input_count , uint8_t output_count )
+{
+  railcan_message_info_t info;
+  struct librailcan_module* module;
+  const struct librailcan_timestamp timestamp = { 0 , 0 };
+
+  memset( &info , 0 , sizeof( info ) );
+  info.node_type = type;
+  info.io.digital_input_count = input_count;
+  info.io.digital_output_count = output_count;
+
+  bus_received( bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_INFO , address ) , sizeof( info ) , &info , &timestamp );
+
+  if( librailcan_module_open( bus , address , &module ) != LIBRAILCAN_STATUS_SUCCESS ||
+      librailcan_module_set_active( module , true ) != LIBRAILCAN_STATUS_SUCCESS )
+    exit( EXIT_FAILURE );
+
+  return module;
+}
+
+static struct librailcan_module* add_dcc_module( struct librailcan_bus* bus , uint8_t address , unsigned int locomotives , uint8_t scheduler )
+{
+  struct librailcan_module* module = add_module( bus , address , LIBRAILCAN_MODULETYPE_DCC , 0 , 0 );
+
+  librailcan_dcc_set_expected_locomotive_count( module , locomotives );
+  librailcan_dcc_set_scheduler( module , scheduler );
+  librailcan_dcc_set_enabled( module , true );
+
+  for( unsigned int i = 0 ; i < locomotives ; i++ )
+  {
+    const uint16_t address = LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG | ( i + 1 );
+
+    librailcan_dcc_locomotive_set_speed( module , address , LIBRAILCAN_DCC_LOCOMOTIVE_SPEED_128 | ( i % 127 ) );
+    librailcan_dcc_locomotive_set_function( module , address , 0 , LIBRAILCAN_DCC_LOCOMOTIVE_FUNCTION_ENABLED );
+  }
+
+  return module;
+}
+
+/*
+ * Benchmarks
+ */
+
+struct io_context
+{
+  struct librailcan_bus* bus;
+  struct librailcan_module* module;
+  uint8_t address;
+};
+
+static void bench_bus_received( void* context , size_t iterations )
+{
+  struct io_context* c = context;
+  const struct librailcan_timestamp timestamp = { 0 , 0 };
+  uint8_t data[ 8 ] = { 0 };
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+  {
+    data[ 0 ] = i & 1; // one input change per frame
+    bus_received( c->bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_INPUTS , c->address ) , sizeof( data ) , data , &timestamp );
+  }
+}
+
+static void bench_module_io_received( void* context , size_t iterations )
+{
+  struct io_context* c = context;
+  const struct librailcan_timestamp timestamp = { 0 , 0 };
+  uint8_t data[ 2 ][ 8 ];
+
+  memset( data[ 0 ] , 0x55 , sizeof( data[ 0 ] ) );
+  memset( data[ 1 ] , 0xaa , sizeof( data[ 1 ] ) ); // every input changes
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+    module_io_received( c->module , RAILCAN_SID( RAILCAN_SID_MESSAGE_INPUTS , c->address ) , sizeof( data[ 0 ] ) , data[ i & 1 ] , &timestamp );
+}
+
+static void bench_module_io_received_unchanged( void* context , size_t iterations )
+{
+  struct io_context* c = context;
+  const struct librailcan_timestamp timestamp = { 0 , 0 };
+  uint8_t data[ 8 ];
+
+  memset( data , 0x55 , sizeof( data ) ); // resent frame, nothing changes
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+    module_io_received( c->module , RAILCAN_SID( RAILCAN_SID_MESSAGE_INPUTS , c->address ) , sizeof( data ) , data , &timestamp );
+}
+
+struct dcc_context
+{
+  struct librailcan_module* module;
+  unsigned int locomotives;
+  struct dcc_packet* packet;
+};
+
+static void bench_module_dcc_received( void* context , size_t iterations )
+{
+  struct dcc_context* c = context;
+  const struct librailcan_timestamp timestamp = { 0 , 0 };
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+    module_dcc_received( c->module , RAILCAN_SID( RAILCAN_SID_MESSAGE_DCC , c->module->address ) , LIBRAILCAN_DLC_RTR , NULL , &timestamp );
+}
+
+static void bench_module_dcc_packet_set_speed( void* context , size_t iterations )
+{
+  struct dcc_context* c = context;
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+    module_dcc_packet_set_speed( c->module , c->packet , dcc_128 , i % 127 );
+}
+
+static void bench_module_dcc_packet_set_function( void* context , size_t iterations )
+{
+  struct dcc_context* c = context;
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+    module_dcc_packet_set_function( c->module , c->packet , 1 + ( i & 3 ) , ( i >> 2 ) & 1 );
+}
+
+static void bench_module_dcc_packet_list_get( void* context , size_t iterations )
+{
+  struct dcc_context* c = context;
+  struct dcc_packet* packet;
+  uint32_t random = 2463534242;
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+  {
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+
+    module_dcc_packet_list_get( c->module , LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG | ( 1 + random % c->locomotives ) , dcc_speed_and_direction , &packet );
+  }
+}
+
+#ifdef HAVE_LINUX_CAN_H
+static void bench_socketcan_send( void* context , size_t iterations )
+{
+  struct librailcan_bus* bus = context;
+  const uint8_t data[ 8 ] = { 1 , 2 , 3 , 4 , 5 , 6 , 7 , 8 };
+
+  for( size_t i = 0 ; i < iterations ; i++ )
+  {
+    socketcan_send( bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_OUTPUTS , 1 ) , sizeof( data ) , data );
+
+    if( bus->socketcan.send_queue.count == bus->socketcan.send_queue.capacity ) // drop instead of writing to the socket
+    {
+      bus->socketcan.send_queue.front = 0;
+      bus->socketcan.send_queue.count = 0;
+    }
+  }
+}
+#endif
+
+int main( int argc , char* argv[] )
+{
+  char params[ 64 ];
+
+  if( argc > 1 )
+    filter = argv[ 1 ];
+
+  // Bus dispatch and input unpacking:
+  {
+    struct io_context c = { .bus = open_bus() , .address = 1 };
+
+    c.module = add_module( c.bus , c.address , LIBRAILCAN_MODULETYPE_IO , 64 , 64 );
+    for( uint8_t address = 2 ; address <= 32 ; address++ )
+      add_module( c.bus , address , LIBRAILCAN_MODULETYPE_IO , 64 , 64 );
+
+    run( "bus_received" , "modules=32,inputs=64" , bench_bus_received , &c );
+    run( "module_io_received" , "inputs=64" , bench_module_io_received , &c );
+    run( "module_io_received_unchanged" , "inputs=64" , bench_module_io_received_unchanged , &c );
+
+    librailcan_bus_close( c.bus );
+  }
+
+  // DCC packet selection:
+  static const unsigned int locomotive_counts[] = { 10 , 1000 , 10000 };
+  static const char* const scheduler_names[] = { "round_robin" , "earliest_deadline" };
+
+  for( size_t i = 0 ; i < sizeof( locomotive_counts ) / sizeof( locomotive_counts[ 0 ] ) ; i++ )
+    for( uint8_t scheduler = LIBRAILCAN_DCC_SCHEDULER_ROUND_ROBIN ; scheduler <= LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE ; scheduler++ )
+    {
+      struct librailcan_bus* bus = open_bus();
+      struct dcc_context c = {
+        .module = add_dcc_module( bus , 1 , locomotive_counts[ i ] , scheduler ) ,
+        .locomotives = locomotive_counts[ i ]
+      };
+
+      snprintf( params , sizeof( params ) , "locomotives=%u,scheduler=%s" , c.locomotives , scheduler_names[ scheduler ] );
+      run( "module_dcc_received" , params , bench_module_dcc_received , &c );
+
+      if( scheduler == LIBRAILCAN_DCC_SCHEDULER_ROUND_ROBIN )
+      {
+        snprintf( params , sizeof( params ) , "locomotives=%u" , c.locomotives );
+        run( "module_dcc_packet_list_get" , params , bench_module_dcc_packet_list_get , &c );
+
+        module_dcc_packet_list_get( c.module , LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG | 1 , dcc_speed_and_direction , &c.packet );
+        run( "module_dcc_packet_set_speed" , params , bench_module_dcc_packet_set_speed , &c );
+
+        module_dcc_packet_list_get( c.module , LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG | 1 , dcc_f0_f4 , &c.packet );
+        run( "module_dcc_packet_set_function" , params , bench_module_dcc_packet_set_function , &c );
+      }
+
+      librailcan_bus_close( bus );
+    }
+
+#ifdef HAVE_LINUX_CAN_H
+  // Send queue enqueue, the socket is never written:
+  {
+    struct librailcan_bus* bus;
+    int sv[ 2 ];
+
+    if( socketpair( AF_UNIX , SOCK_SEQPACKET , 0 , sv ) == -1 ||
+        bus_open( if_socketcan , &bus ) != LIBRAILCAN_STATUS_SUCCESS ||
+        socketcan_open( bus , sv[ 0 ] ) != LIBRAILCAN_STATUS_SUCCESS )
+      return EXIT_FAILURE;
+
+    run( "socketcan_send" , "dlc=8" , bench_socketcan_send , bus );
+
+    librailcan_bus_close( bus );
+    close( sv[ 1 ] );
+  }
+#endif
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+/*
+ * End-to-end DCC reply latency benchmark.
+ *
+ * A forked peer process plays the DCC command station: it sends DCC RTRs at a fixed rate and measures the time until
+ * the reply arrives, while this process serves the bus through the library. Runs on a (v)can interface, or on a
+ * socket pair when the interface isn't available. Prints one JSON line with the latency distribution, the missed
+ * deadlines and the packet mix.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/can.h>
+#include "../shared/railcan-proto/railcan_proto.h"
+#include "librailcan.h"
+
+#define COMMAND_STATION_ADDRESS  1
+
+struct options
+{
+  const char* interface;
+  unsigned int rate; //!< RTRs per second.
+  unsigned int duration; //!< Seconds.
+  unsigned int deadline; //!< Microseconds.
+  unsigned int locomotives;
+  unsigned int changes; //!< Speed changes per second.
+  uint8_t scheduler;
+};
+
+struct result
+{
+  size_t requests;
+  size_t replies;
+  size_t missed;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+static uint64_t now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC , &ts );
+
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_uint64( const void* a , const void* b )
+{
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+
+  return ( x > y ) - ( x < y );
+}
+
+static int open_can( const char* interface )
+{
+  int fd = socket( PF_CAN , SOCK_RAW , CAN_RAW );
+  if( fd == -1 )
+    return -1;
+
+  struct ifreq ifr;
+  memset( &ifr , 0 , sizeof( ifr ) );
+  strncpy( ifr.ifr_name , interface , IFNAMSIZ - 1 );
+
+  struct sockaddr_can addr;
+  memset( &addr , 0 , sizeof( addr ) );
+  addr.can_family = AF_CAN;
+
+  if( ioctl( fd , SIOCGIFINDEX , &ifr ) == -1 ||
+      ( addr.can_ifindex = ifr.ifr_ifindex , bind( fd , (struct sockaddr*)&addr , sizeof( addr ) ) == -1 ) )
+  {
+    close( fd );
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * \brief Open the two ends of the bus, bring up a vcan interface if needed and possible.
+ */
+static const char* open_transport( const char* interface , int* library_fd , int* peer_fd )
+{
+  if( if_nametoindex( interface ) == 0 && strncmp( interface , "vcan" , 4 ) == 0 )
+  {
+    char command[ 128 ];
+
+    snprintf( command , sizeof( command ) , "ip link add dev %s type vcan 2>/dev/null && ip link set up %s" , interface , interface );
+    if( system( command ) != 0 )
+      fprintf( stderr , "can't create %s, using a socket pair\n" , interface );
+  }
+
+  if( ( *library_fd = open_can( interface ) ) != -1 )
+  {
+    if( ( *peer_fd = open_can( interface ) ) != -1 )
+      return interface;
+
+    close( *library_fd );
+  }
+
+  int sv[ 2 ];
+
+  if( socketpair( AF_UNIX , SOCK_SEQPACKET , 0 , sv ) == -1 )
+  {
+    perror( "socketpair" );
+    exit( EXIT_FAILURE );
+  }
+
+  *library_fd = sv[ 0 ];
+  *peer_fd = sv[ 1 ];
+
+  return "socketpair";
+}
+
+/**
+ * \brief Command station: announce itself, then request DCC packets at a fixed rate until the duration has elapsed.
+ */
+static void command_station( const struct options* options , int fd , int start_fd , int result_fd )
+{
+  struct can_frame frame;
+  railcan_message_info_t info;
+  struct result result;
+  char c;
+
+  memset( &info , 0 , sizeof( info ) );
+  info.node_type = LIBRAILCAN_MODULETYPE_DCC;
+
+  memset( &frame , 0 , sizeof( frame ) );
+  frame.can_id = RAILCAN_SID( RAILCAN_SID_MESSAGE_INFO , COMMAND_STATION_ADDRESS );
+  frame.can_dlc = sizeof( info ) < CAN_MAX_DLEN ? sizeof( info ) : CAN_MAX_DLEN;
+  memcpy( frame.data , &info , frame.can_dlc );
+
+  if( write( fd , &frame , sizeof( frame ) ) != sizeof( frame ) || read( start_fd , &c , 1 ) != 1 )
+    exit( EXIT_FAILURE );
+
+  const uint64_t period = 1000000000ULL / options->rate;
+  const uint64_t deadline = (uint64_t)options->deadline * 1000;
+  const size_t count = (size_t)options->rate * options->duration;
+  uint64_t* sent = malloc( count * sizeof( *sent ) );
+  uint64_t* latencies = malloc( count * sizeof( *latencies ) );
+  const uint64_t start = now();
+
+  if( !sent || !latencies )
+    exit( EXIT_FAILURE );
+
+  memset( &result , 0 , sizeof( result ) );
+
+  size_t pending = 0; // oldest unanswered request
+
+  while( pending < count )
+  {
+    const uint64_t next = start + result.requests * period;
+    const uint64_t t = now();
+
+    if( result.requests < count && t >= next )
+    {
+      // A request still unanswered has lost its reply, a late reply is matched to the new request instead of shifting
+      // all following matches:
+      result.missed += result.requests - pending;
+      pending = result.requests;
+
+      memset( &frame , 0 , sizeof( frame ) );
+      frame.can_id = RAILCAN_SID( RAILCAN_SID_MESSAGE_DCC , COMMAND_STATION_ADDRESS ) | CAN_RTR_FLAG;
+      if( write( fd , &frame , sizeof( frame ) ) != sizeof( frame ) )
+        exit( EXIT_FAILURE );
+
+      sent[ result.requests++ ] = now();
+      continue;
+    }
+    else if( result.requests == count && t > sent[ count - 1 ] + period + deadline ) // remaining replies are lost
+      break;
+
+    struct pollfd pfd = { .fd = fd , .events = POLLIN , .revents = 0 };
+    const int timeout = ( result.requests < count && next > t ) ? (int)( ( next - t + 999999 ) / 1000000 ) : 1;
+
+    if( poll( &pfd , 1 , timeout ) <= 0 )
+      continue;
+
+    if( read( fd , &frame , sizeof( frame ) ) <= 0 )
+      break;
+
+    if( frame.can_id != RAILCAN_SID( RAILCAN_SID_MESSAGE_DCC , COMMAND_STATION_ADDRESS ) || pending == result.requests )
+      continue;
+
+    const uint64_t latency = now() - sent[ pending++ ];
+
+    latencies[ result.replies++ ] = latency;
+    if( latency > deadline ) // the track got an idle packet instead
+      result.missed++;
+  }
+
+  result.missed += result.requests - pending;
+
+  if( result.replies > 0 )
+  {
+    qsort( latencies , result.replies , sizeof( *latencies ) , compare_uint64 );
+    result.p50 = latencies[ result.replies * 50 / 100 ];
+    result.p90 = latencies[ result.replies * 90 / 100 ];
+    result.p99 = latencies[ result.replies * 99 / 100 ];
+    result.p999 = latencies[ result.replies * 999 / 1000 ];
+    result.max = latencies[ result.replies - 1 ];
+  }
+
+  if( write( result_fd , &result , sizeof( result ) ) != sizeof( result ) )
+    exit( EXIT_FAILURE );
+
+  exit( EXIT_SUCCESS );
+}
+
+static void usage( const char* name )
+{
+  fprintf( stderr ,
+    "Usage: %s [-i interface] [-r rate] [-t seconds] [-d deadline_us] [-l locomotives] [-c changes] [-e]\n"
+    "  -i  CAN interface, default vcan0, a socket pair is used if it's unavailable\n"
+    "  -r  DCC requests per second, default 150\n"
+    "  -t  duration in seconds, default 10\n"
+    "  -d  reply deadline in microseconds, default 1000\n"
+    "  -l  number of locomotives, default 100\n"
+    "  -c  speed changes per second, default 10\n"
+    "  -e  use the earliest deadline first scheduler\n" , name );
+  exit( EXIT_FAILURE );
+}
+
+int main( int argc , char* argv[] )
+{
+  struct options options = {
+    .interface = "vcan0" ,
+    .rate = 150 ,
+    .duration = 10 ,
+    .deadline = 1000 ,
+    .locomotives = 100 ,
+    .changes = 10 ,
+    .scheduler = LIBRAILCAN_DCC_SCHEDULER_ROUND_ROBIN
+  };
+  int opt;
+
+  while( ( opt = getopt( argc , argv , "i:r:t:d:l:c:e" ) ) != -1 )
+    switch( opt )
+    {
+      case 'i': options.interface = optarg; break;
+      case 'r': options.rate = strtoul( optarg , NULL , 0 ); break;
+      case 't': options.duration = strtoul( optarg , NULL , 0 ); break;
+      case 'd': options.deadline = strtoul( optarg , NULL , 0 ); break;
+      case 'l': options.locomotives = strtoul( optarg , NULL , 0 ); break;
+      case 'c': options.changes = strtoul( optarg , NULL , 0 ); break;
+      case 'e': options.scheduler = LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE; break;
+      default: usage( argv[ 0 ] );
+    }
+
+  if( options.rate == 0 || options.duration == 0 || options.locomotives == 0 || options.locomotives > 10239 )
+    usage( argv[ 0 ] );
+
+  int library_fd , peer_fd , start_pipe[ 2 ] , result_pipe[ 2 ];
+  const char* transport = open_transport( options.interface , &library_fd , &peer_fd );
+
+  if( pipe( start_pipe ) == -1 || pipe( result_pipe ) == -1 )
+    return EXIT_FAILURE;
+
+  const pid_t pid = fork();
+  if( pid == -1 )
+    return EXIT_FAILURE;
+  else if( pid == 0 )
+  {
+    close( library_fd );
+    close( start_pipe[ 1 ] );
+    close( result_pipe[ 0 ] );
+    command_station( &options , peer_fd , start_pipe[ 0 ] , result_pipe[ 1 ] );
+  }
+
+  close( peer_fd );
+  close( start_pipe[ 0 ] );
+  close( result_pipe[ 1 ] );
+
+  struct librailcan_bus* bus;
+  struct librailcan_module* module = NULL;
+
+  if( librailcan_bus_open_socketcan_fd( library_fd , &bus ) != LIBRAILCAN_STATUS_SUCCESS )
+    goto error;
+
+  // Wait for the command station to announce itself:
+  const uint64_t timeout = now() + 1000000000ULL;
+  while( librailcan_module_open( bus , COMMAND_STATION_ADDRESS , &module ) != LIBRAILCAN_STATUS_SUCCESS )
+    if( now() > timeout || librailcan_bus_process( bus , 10 ) < 0 )
+      goto error;
+
+  librailcan_module_set_active( module , true );
+  librailcan_dcc_set_expected_locomotive_count( module , options.locomotives );
+  librailcan_dcc_set_scheduler( module , options.scheduler );
+  librailcan_dcc_set_enabled( module , true );
+
+  for( unsigned int i = 0 ; i < options.locomotives ; i++ )
+    librailcan_dcc_locomotive_set_speed( module , LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG | ( i + 1 ) , LIBRAILCAN_DCC_LOCOMOTIVE_SPEED_128 | ( i % 127 ) );
+
+  if( write( start_pipe[ 1 ] , "s" , 1 ) != 1 )
+    goto error;
+
+  // Serve the bus until the command station reports:
+  const uint64_t change_period = options.changes ? 1000000000ULL / options.changes : UINT64_MAX;
+  uint64_t next_change = now();
+  unsigned int change = 0;
+  struct result result;
+
+  for( ;; )
+  {
+    struct pollfd pfd[ 2 ] = {
+      { .fd = library_fd , .events = 0 , .revents = 0 } ,
+      { .fd = result_pipe[ 0 ] , .events = POLLIN , .revents = 0 }
+    };
+
+    librailcan_bus_get_poll_events( bus , &pfd[ 0 ].events );
+
+    if( poll( pfd , 2 , 1 ) == -1 )
+      goto error;
+
+    if( pfd[ 1 ].revents ) // done, the peer may have closed its socket already
+    {
+      if( read( result_pipe[ 0 ] , &result , sizeof( result ) ) != sizeof( result ) )
+        goto error;
+      break;
+    }
+
+    if( pfd[ 0 ].revents && librailcan_bus_process_poll( bus , pfd[ 0 ].revents ) < 0 )
+      goto error;
+
+    if( now() >= next_change )
+    {
+      const uint16_t address = LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG | ( 1 + change % options.locomotives );
+
+      librailcan_dcc_locomotive_set_speed( module , address , LIBRAILCAN_DCC_LOCOMOTIVE_SPEED_128 | ( change % 127 ) );
+      change++;
+      next_change += change_period;
+    }
+  }
+
+  waitpid( pid , NULL , 0 );
+
+  struct librailcan_dcc_stats stats;
+  librailcan_dcc_get_stats( module , &stats , sizeof( stats ) );
+
+  printf( "{\"benchmark\":\"dcc_latency\",\"transport\":\"%s\",\"rate\":%u,\"locomotives\":%u,\"scheduler\":\"%s\","
+          "\"requests\":%zu,\"replies\":%zu,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,"
+          "\"deadline_us\":%u,\"missed\":%zu,"
+          "\"idle_packets\":%zu,\"queue_packets\":%zu,\"priority_packets\":%zu,\"user_packets\":%zu}\n" ,
+    transport , options.rate , options.locomotives ,
+    options.scheduler == LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE ? "earliest_deadline" : "round_robin" ,
+    result.requests , result.replies ,
+    result.p50 / 1000.0 , result.p90 / 1000.0 , result.p99 / 1000.0 , result.p999 / 1000.0 , result.max / 1000.0 ,
+    options.deadline , result.missed ,
+    stats.idle_packets_sent , stats.queue_packets_sent , stats.priority_queue_packets_sent , stats.user_packets_sent );
+
+  librailcan_bus_close( bus );
+
+  return EXIT_SUCCESS;
+
+error:
+  fprintf( stderr , "benchmark failed\n" );
+  kill( pid , SIGTERM );
+  waitpid( pid , NULL , 0 );
+
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,163 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#include "allocator.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void* default_malloc( size_t size , void* user_data )
+{
+  (void)user_data;
+
+  return malloc( size );
+}
+
+static void* default_calloc( size_t count , size_t size , void* user_data )
+{
+  (void)user_data;
+
+  return calloc( count , size );
+}
+
+static void* default_realloc( void* ptr , size_t size , void* user_data )
+{
+  (void)user_data;
+
+  return realloc( ptr , size );
+}
+
+static void default_free( void* ptr , void* user_data )
+{
+  (void)user_data;
+
+  free( ptr );
+}
+
+static struct librailcan_allocator allocator = {
+  .malloc = default_malloc ,
+  .calloc = default_calloc ,
+  .realloc = default_realloc ,
+  .free = default_free ,
+  .user_data = NULL
+};
+
+static struct librailcan_allocation_stats stats;
+static unsigned int realtime_buses; //!< Number of buses in real-time mode.
+
+static inline void count_allocation( void )
+{
+  __atomic_add_fetch( &stats.allocations , 1 , __ATOMIC_RELAXED );
+
+  if( __atomic_load_n( &realtime_buses , __ATOMIC_RELAXED ) > 0 )
+    __atomic_add_fetch( &stats.realtime_allocations , 1 , __ATOMIC_RELAXED );
+}
+
+void* allocator_malloc( size_t size )
+{
+  void* ptr = allocator.malloc( size , allocator.user_data );
+
+  if( ptr )
+    count_allocation();
+
+  return ptr;
+}
+
+void* allocator_calloc( size_t count , size_t size )
+{
+  void* ptr = allocator.calloc( count , size , allocator.user_data );
+
+  if( ptr )
+    count_allocation();
+
+  return ptr;
+}
+
+void* allocator_realloc( void* ptr , size_t size )
+{
+  if( size == 0 ) // a free, counted as such
+  {
+    allocator_free( ptr );
+    return NULL;
+  }
+
+  void* p = allocator.realloc( ptr , size , allocator.user_data );
+
+  if( p && !ptr )
+    count_allocation();
+  else if( p ) // a resize counts as an allocation in real-time mode only
+  {
+    if( __atomic_load_n( &realtime_buses , __ATOMIC_RELAXED ) > 0 )
+      __atomic_add_fetch( &stats.realtime_allocations , 1 , __ATOMIC_RELAXED );
+  }
+
+  return p;
+}
+
+void allocator_free( void* ptr )
+{
+  if( !ptr )
+    return;
+
+  __atomic_add_fetch( &stats.frees , 1 , __ATOMIC_RELAXED );
+
+  allocator.free( ptr , allocator.user_data );
+}
+
+void allocator_realtime( bool enter )
+{
+  if( enter )
+    __atomic_add_fetch( &realtime_buses , 1 , __ATOMIC_RELAXED );
+  else
+    __atomic_sub_fetch( &realtime_buses , 1 , __ATOMIC_RELAXED );
+}
+
+int librailcan_set_allocator( const struct librailcan_allocator* new_allocator )
+{
+  if( new_allocator && ( !new_allocator->malloc || !new_allocator->calloc || !new_allocator->realloc || !new_allocator->free ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( __atomic_load_n( &stats.allocations , __ATOMIC_RELAXED ) != __atomic_load_n( &stats.frees , __ATOMIC_RELAXED ) )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL; // memory of the current allocator is in use
+
+  if( new_allocator )
+    allocator = *new_allocator;
+  else
+  {
+    allocator.malloc = default_malloc;
+    allocator.calloc = default_calloc;
+    allocator.realloc = default_realloc;
+    allocator.free = default_free;
+    allocator.user_data = NULL;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_get_allocation_stats( struct librailcan_allocation_stats* stats_out , size_t stats_size )
+{
+  if( !stats_out || stats_size < sizeof( *stats_out ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  stats_out->allocations = __atomic_load_n( &stats.allocations , __ATOMIC_RELAXED );
+  stats_out->frees = __atomic_load_n( &stats.frees , __ATOMIC_RELAXED );
+  stats_out->realtime_allocations = __atomic_load_n( &stats.realtime_allocations , __ATOMIC_RELAXED );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
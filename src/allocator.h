@@ -0,0 +1,44 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef _ALLOCATOR_H_
+#define _ALLOCATOR_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "librailcan.h"
+
+/**
+ * \brief Allocate memory through the allocator selected with librailcan_set_allocator().
+ *
+ * All library memory goes through these functions, allocations made while a bus is in real-time mode are counted.
+ */
+void* allocator_malloc( size_t size );
+void* allocator_calloc( size_t count , size_t size );
+void* allocator_realloc( void* ptr , size_t size );
+void allocator_free( void* ptr );
+
+/**
+ * \brief Enter or leave real-time mode, nests per bus.
+ */
+void allocator_realtime( bool enter );
+
+#endif
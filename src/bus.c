@@ -26,6 +26,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #ifdef HAVE_LINUX_CAN_H
 #  include <linux/can.h>
 #  include <net/if.h>
@@ -37,8 +38,14 @@
 #ifdef HAVE_POLL_H
 #  include <poll.h>
 #endif
+#include "allocator.h"
 #include "module.h"
 #include "socketcan.h"
+#include "virtual.h"
+#include "replay.h"
+#include "trace.h"
+#include "reactor.h"
+#include "io_thread.h"
 #include "../shared/railcan-proto/railcan_proto.h"
 #include "log.h"
 
@@ -80,31 +87,45 @@ int librailcan_bus_open_socketcan( const char* device , struct librailcan_bus**
   if( bind( fd , (struct sockaddr*)&addr , sizeof( addr ) ) == -1 )
     goto error;
 
-  // select non-blocking mode
-  fcntl( fd , F_SETFL , fcntl( fd , F_GETFL , 0 ) | O_NONBLOCK );
+  int r = librailcan_bus_open_socketcan_fd( fd , bus );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    close( fd );
 
-#ifdef HAVE_LINUX_CAN_RAW_H
-  // setup filter for std frames only
-  struct can_filter filter[1];
-  filter[0].can_id   = 0;
-  filter[0].can_mask = CAN_EFF_FLAG;
-  setsockopt( fd , SOL_CAN_RAW , CAN_RAW_FILTER , &filter , sizeof( filter ) );
+  return r;
+
+error:
+  close( fd );
+
+error_no_socket:
+  return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 #endif
+}
+
+int librailcan_bus_open_socketcan_fd( int fd , struct librailcan_bus** bus )
+{
+#ifdef HAVE_LINUX_CAN_H
+  if( fd < 0 || !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  // select non-blocking mode
+  fcntl( fd , F_SETFL , fcntl( fd , F_GETFL , 0 ) | O_NONBLOCK );
 
   int r = bus_open( if_socketcan , bus );
   if( r != LIBRAILCAN_STATUS_SUCCESS )
     return r;
 
-  (*bus)->socketcan.fd = fd;
-  (*bus)->send = socketcan_send;
+  if( ( r = socketcan_open( *bus , fd ) ) != LIBRAILCAN_STATUS_SUCCESS )
+  {
+    (*bus)->socketcan.fd = -1; // owned by the caller on failure
+    socketcan_close( *bus );
+    allocator_free( *bus );
+    *bus = NULL;
+    return r;
+  }
 
   return LIBRAILCAN_STATUS_SUCCESS;
-
-error:
-  close( fd );
-
-error_no_socket:
-  return LIBRAILCAN_STATUS_UNSUCCESSFUL;
 #else
   return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 #endif
@@ -115,15 +136,39 @@ int librailcan_bus_close( struct librailcan_bus* bus )
   if( !bus )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  io_thread_stop( bus );
+
+#ifdef HAVE_SYS_EPOLL_H
+  if( bus->reactor_source )
+    reactor_remove_bus( bus );
+#endif
+
+  if( bus->trace )
+    trace_stop( bus );
+
+  // Free modules through their own free, last first so removal doesn't shift the list:
+  while( bus->module_count > 0 )
+  {
+    struct librailcan_module* module = bus->modules[ bus->module_count - 1 ];
+
+    if( module->is_open )
+      module->close( module );
+    module->free( module );
+  }
+
   if( bus->interface == if_socketcan )
-    close( bus->socketcan.fd );
+    socketcan_close( bus );
+  else if( bus->interface == if_virtual )
+    virtual_close( bus );
+  else if( bus->interface == if_replay )
+    replay_close( bus );
 
-  for( int i = 0 ; i < bus->module_count ; i++ )
-    free( bus->modules[ i ] );
+  if( bus->realtime )
+    allocator_realtime( false );
 
-  free( bus->modules );
+  allocator_free( bus->modules );
 
-  free( bus );
+  allocator_free( bus );
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
@@ -149,7 +194,7 @@ int librailcan_bus_get_poll_events( struct librailcan_bus* bus , short* events )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
   *events = POLLIN;
-  if( bus->socketcan.send_queue.front )
+  if( socketcan_send_pending( bus ) )
     *events |= POLLOUT;
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -165,51 +210,16 @@ int librailcan_bus_process_poll( struct librailcan_bus* bus , short revents )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
   else if( bus->interface != if_socketcan )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+  else if( bus->io_thread )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
 
-  if( revents & POLLOUT )
-    while( bus->socketcan.send_queue.front )
-    {
-      struct can_queue_item* item = bus->socketcan.send_queue.front;
-
-      ssize_t r = write( bus->socketcan.fd , &item->frame , sizeof( item->frame ) );
-
-      if( r == sizeof( item->frame ) )
-      {
-        bus->socketcan.send_queue.front = item->next;
-        free( item );
-      }
-      else if( r == 0 )
-        break;
-      else
-      {
-        LOG_ERROR( "write: r = %zd [%m]\n" , r );
-        return LIBRAILCAN_STATUS_UNSUCCESSFUL;
-      }
-    }
-
-  if( revents & POLLIN )
-    while( 1 )
-    {
-      struct can_frame frame;
+  int r;
 
-      ssize_t r = read( bus->socketcan.fd , &frame , sizeof( frame ) );
+  if( ( revents & POLLOUT ) && ( r = socketcan_flush( bus ) ) != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
 
-      if( r == sizeof( frame ) )
-      {
-#ifndef HAVE_LINUX_CAN_RAW_H
-        if( frame.can_id & CAN_EFF_FLAG ) // ignore extended frames
-          continue;
-#endif
-        bus_received( bus , frame.can_id & CAN_SFF_MASK , ( frame.can_id & CAN_RTR_FLAG ) ? LIBRAILCAN_DLC_RTR : frame.can_dlc , frame.data );
-      }
-      else if( r == 0 || ( r == -1 && errno == EAGAIN ) )
-        break;
-      else
-      {
-        LOG_ERROR( "read: r = %zd [%m]\n" , r );
-        return LIBRAILCAN_STATUS_UNSUCCESSFUL;
-      }
-    }
+  if( ( revents & POLLIN ) && ( r = socketcan_receive( bus , bus->socketcan.receive_budget ) ) != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
 
   return LIBRAILCAN_STATUS_SUCCESS;
 #else
@@ -224,10 +234,12 @@ int librailcan_bus_process( struct librailcan_bus* bus , int timeout )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
   else if( bus->interface != if_socketcan )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+  else if( bus->io_thread )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
 
   struct pollfd fd = {
     fd : bus->socketcan.fd ,
-    events : bus->socketcan.send_queue.front ? POLLIN | POLLOUT : POLLIN , 
+    events : socketcan_send_pending( bus ) ? POLLIN | POLLOUT : POLLIN , 
     revents : 0
   };
 
@@ -244,14 +256,191 @@ int librailcan_bus_process( struct librailcan_bus* bus , int timeout )
 #endif
 }
 
+int librailcan_bus_set_receive_budget( struct librailcan_bus* bus , unsigned int frames )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_set_receive_budget , bus , frames , 0 , 0 , 0 , 0 );
+
+  bus->socketcan.receive_budget = frames;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_set_send_queue_capacity( struct librailcan_bus* bus , size_t capacity )
+{
+  if( !bus || capacity == 0 )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_set_send_queue_capacity , bus , capacity , 0 , 0 , 0 , 0 );
+
+  return socketcan_resize_send_queue( bus , capacity );
+}
+
+int librailcan_bus_set_send_queue_overflow_policy( struct librailcan_bus* bus , uint8_t policy )
+{
+  if( !bus || ( policy != LIBRAILCAN_SEND_QUEUE_OVERFLOW_REJECT && policy != LIBRAILCAN_SEND_QUEUE_OVERFLOW_GROW ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_set_send_queue_overflow_policy , bus , policy , 0 , 0 , 0 , 0 );
+
+  bus->socketcan.send_queue.overflow_policy = policy;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_cork( struct librailcan_bus* bus )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_cork , bus , 0 , 0 , 0 , 0 , 0 );
+
+  socketcan_cork( bus );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_uncork( struct librailcan_bus* bus )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_uncork , bus , 0 , 0 , 0 , 0 , 0 );
+
+  return socketcan_uncork( bus );
+}
+
+int librailcan_bus_set_output_coalescing( struct librailcan_bus* bus , librailcan_bool enabled )
+{
+  if( !bus || enabled > LIBRAILCAN_BOOL_TRUE )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_set_output_coalescing , bus , enabled , 0 , 0 , 0 , 0 );
+
+  bus->socketcan.coalesce_outputs = ( enabled == LIBRAILCAN_BOOL_TRUE );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_set_kernel_filter( struct librailcan_bus* bus , librailcan_bool enabled )
+{
+  if( !bus || enabled > LIBRAILCAN_BOOL_TRUE )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( bus , io_cmd_bus_set_kernel_filter , bus , enabled , 0 , 0 , 0 , 0 );
+
+  bus->socketcan.kernel_filter = ( enabled == LIBRAILCAN_BOOL_TRUE );
+
+  return socketcan_update_filter( bus );
+}
+
+int librailcan_bus_set_can_fd( struct librailcan_bus* bus , librailcan_bool enabled )
+{
+  if( !bus || enabled > LIBRAILCAN_BOOL_TRUE )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  IO_THREAD_POST( bus , io_cmd_bus_set_can_fd , bus , enabled , 0 , 0 , 0 , 0 );
+
+  if( bus->interface == if_socketcan )
+  {
+    int r = socketcan_set_can_fd( bus , enabled == LIBRAILCAN_BOOL_TRUE );
+    if( r != LIBRAILCAN_STATUS_SUCCESS )
+      return r;
+  }
+
+  bus->frame_data_max = ( enabled == LIBRAILCAN_BOOL_TRUE ) ? LIBRAILCAN_FD_DATA_MAX : LIBRAILCAN_DATA_MAX;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static int reserve_modules( struct librailcan_bus* bus , size_t length )
+{
+  if( bus->modules_length >= length )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  void* new = allocator_realloc( bus->modules , length * sizeof( *bus->modules ) );
+  if( !new )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  bus->modules = new;
+  bus->modules_length = length;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_set_realtime( struct librailcan_bus* bus , librailcan_bool enabled )
+{
+  if( !bus || enabled > LIBRAILCAN_BOOL_TRUE )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->io_thread )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  if( enabled )
+  {
+    // Room for a module at every address:
+    int r = reserve_modules( bus , RAILCAN_SID_ADDRESS_LAST - RAILCAN_SID_ADDRESS_FIRST + 1 );
+    if( r != LIBRAILCAN_STATUS_SUCCESS )
+      return r;
+
+    for( size_t i = 0 ; i < bus->module_count ; i++ )
+      if( ( r = bus->modules[ i ]->reserve( bus->modules[ i ] ) ) != LIBRAILCAN_STATUS_SUCCESS )
+        return r;
+  }
+
+  if( enabled && !bus->realtime )
+    allocator_realtime( true );
+  else if( !enabled && bus->realtime )
+    allocator_realtime( false );
+
+  bus->realtime = enabled;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_get_stats( struct librailcan_bus* bus , struct librailcan_bus_stats* stats , size_t stats_size )
+{
+  if( !bus || !stats || stats_size < sizeof( *stats ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  IO_THREAD_POST( bus , io_cmd_bus_get_stats , bus , stats , stats_size , 0 , 0 , 0 );
+
+  memcpy( stats , &bus->stats , sizeof( *stats ) );
+
+  if( bus->interface == if_socketcan )
+    stats->send_queue_count = bus->socketcan.send_queue.count;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
 int librailcan_bus_received( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
 {
-  if( !bus || id > 0x7ff || dlc < LIBRAILCAN_DLC_RTR || dlc > 8 || ( dlc > 0 && !data ) )
+  if( !bus || id > 0x7ff || dlc < LIBRAILCAN_DLC_RTR || dlc > bus->frame_data_max || ( dlc > 0 && !data ) )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
   else if( bus->interface != if_custom )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
-  bus_received( bus , id , dlc , data );
+  struct librailcan_timestamp timestamp = {
+    .software = bus_clock() ,
+    .hardware = 0
+  };
+
+  bus_received( bus , id , dlc , data , &timestamp );
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
@@ -263,6 +452,8 @@ int librailcan_bus_scan( struct librailcan_bus* bus , uint8_t start , uint8_t en
       end < start || end > RAILCAN_SID_ADDRESS_LAST )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST( bus , io_cmd_bus_scan , bus , start , end , 0 , 0 , 0 );
+
   for( unsigned short address = start ; address <= end ; address++ )
     bus->send( bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_INFO , address ) , LIBRAILCAN_DLC_RTR , NULL );
 
@@ -274,11 +465,37 @@ int librailcan_bus_set_scan_callback( struct librailcan_bus* bus , librailcan_bu
   if( !bus )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST_ASYNC( bus , io_cmd_bus_set_scan_callback , bus , callback , 0 , 0 , 0 , 0 );
+
   bus->scan_callback = callback;
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
+int librailcan_bus_set_frame_callback( struct librailcan_bus* bus , librailcan_bus_frame_callback callback )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  IO_THREAD_POST_ASYNC( bus , io_cmd_bus_set_frame_callback , bus , callback , 0 , 0 , 0 , 0 );
+
+  bus->frame_callback = callback;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_get_rx_timestamp( struct librailcan_bus* bus , struct librailcan_timestamp* timestamp )
+{
+  if( !bus || !timestamp )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->rx_timestamp.software == 0 ) // nothing received yet
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  *timestamp = bus->rx_timestamp;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
 int librailcan_bus_get_user_data( struct librailcan_bus* bus , void** data )
 {
   if( !bus || !data )
@@ -299,78 +516,115 @@ int librailcan_bus_set_user_data( struct librailcan_bus* bus , void* data )
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
+uint64_t bus_clock( void )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_REALTIME , &now );
+
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 int bus_open( enum bus_interface interface , struct librailcan_bus** bus )
 {
-  *bus = calloc( 1 , sizeof( **bus ) );
+  *bus = allocator_calloc( 1 , sizeof( **bus ) );
 
   if( !*bus )
     return LIBRAILCAN_STATUS_NO_MEMORY;
 
   (*bus)->interface = interface;
+  (*bus)->send_frame = bus_send_frame_generic;
+  (*bus)->frame_data_max = LIBRAILCAN_DATA_MAX;
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
+int bus_send_frame_generic( struct librailcan_bus* bus , const struct bus_frame* frame )
+{
+  return bus->send( bus , frame->id , frame->dlc , frame->data );
+}
+
 int bus_add_module( struct librailcan_bus* bus , struct librailcan_module* module )
 {
-  if( !bus->modules )
-  {
-    bus->modules_length = 4;
-    bus->modules = malloc( bus->modules_length * sizeof( *bus->modules ) );
-    if( !bus->modules )
-    {
-      bus->modules_length = 0;
-      return LIBRAILCAN_STATUS_NO_MEMORY;
-    }
-  }
-  else if( bus->module_count == bus->modules_length )
-  {
-    void* new = realloc( bus->modules , 2 * bus->modules_length * sizeof( *bus->modules ) );
-    if( !new )
-      return LIBRAILCAN_STATUS_NO_MEMORY;
-    bus->modules = new;
-    bus->modules_length *= 2;
-  }
+  if( bus->module_count == bus->modules_length &&
+      reserve_modules( bus , bus->modules_length ? 2 * bus->modules_length : 4 ) != LIBRAILCAN_STATUS_SUCCESS )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
 
   bus->modules[ bus->module_count ] = module;
   bus->module_count++;
 
+  bus->modules_by_address[ module->address ] = module;
+
+  if( bus->interface == if_socketcan )
+    socketcan_update_filter( bus );
+
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
-void bus_received( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
+void bus_remove_module( struct librailcan_bus* bus , struct librailcan_module* module )
+{
+  for( size_t i = 0 ; i < bus->module_count ; i++ )
+    if( bus->modules[ i ] == module )
+    {
+      bus->module_count--;
+      if( i < bus->module_count )
+        memmove( bus->modules + i , bus->modules + i + 1 , ( bus->module_count - i ) * sizeof( *bus->modules ) );
+      break;
+    }
+
+  if( bus->modules_by_address[ module->address ] == module )
+    bus->modules_by_address[ module->address ] = NULL;
+
+  if( bus->interface == if_socketcan )
+  {
+    socketcan_untag_module( bus , module );
+    socketcan_update_filter( bus );
+  }
+}
+
+void bus_received( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp )
 {
   const uint8_t address = RAILCAN_SID_TO_ADDRESS( id );
 
   LOG_DEBUG( "received: message=%u, address=%u, dlc=%d\n" , RAILCAN_SID_TO_MESSAGE( id ) , address , dlc );
 
+  bus->rx_timestamp = *timestamp;
+
+  if( bus->trace )
+    trace_record( bus , false , timestamp->software , id , dlc , data );
+
+  if( bus->frame_callback )
+    bus->frame_callback( bus , id , dlc , data , timestamp );
+
   if( address == RAILCAN_SID_ADDRESS_BROADCAST ) // broadcast message
   {
     for( int i = 0 ; i < bus->module_count ; i++ )
-      bus->modules[ i ]->received( bus->modules[ i ] , id , dlc , data );
+      bus->modules[ i ]->received( bus->modules[ i ] , id , dlc , data , timestamp );
   }
   else if( address >= RAILCAN_SID_ADDRESS_FIRST &&
            address <= RAILCAN_SID_ADDRESS_LAST )
   {
-    for( int i = 0 ; i < bus->module_count ; i++ )
-      if( bus->modules[ i ]->address == address )
-      {
-        bus->modules[ i ]->received( bus->modules[ i ] , id , dlc , data );
-        return;
-      }
+    struct librailcan_module* module = bus->modules_by_address[ address ];
+
+    if( module )
+    {
+      module->received( module , id , dlc , data , timestamp );
+      return;
+    }
 
     // unknown address, create a new module
     if( RAILCAN_SID_TO_MESSAGE( id ) == RAILCAN_SID_MESSAGE_INFO )
     {
       const railcan_message_info_t* info = (const railcan_message_info_t*) data;
-      struct librailcan_module* module = calloc( 1 , sizeof( *module ) );
+
+      module = allocator_calloc( 1 , sizeof( *module ) );
 
       if( module )
       {
         module->address = address;
         module->bus = bus;
 
-        if( module_init( module , info ) == LIBRAILCAN_STATUS_SUCCESS )
+        if( module_init( module , info , dlc ) == LIBRAILCAN_STATUS_SUCCESS )
         {
           LOG_INFO( "new module: address=%u, type=%u\n" , module->address , module->type );
           bus_add_module( bus , module );
@@ -378,7 +632,7 @@ void bus_received( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const
             bus->scan_callback( bus , module->address , module->type );
         }
         else
-          free( module );
+          allocator_free( module );
       }
     }
   }
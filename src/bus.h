@@ -23,12 +23,40 @@
 #define _BUS_H_
 
 #include "librailcan.h"
+#include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 
 enum bus_interface
 {
   if_custom ,
-  if_socketcan
+  if_socketcan ,
+  if_virtual ,
+  if_replay
+};
+
+/**
+ * \brief Ready to send frame image, layout compatible with the SocketCAN \c struct \c can_frame.
+ */
+struct bus_frame
+{
+  uint32_t id; //!< 11 bit identifier, no flags.
+  uint8_t dlc;
+  uint8_t pad[3];
+  uint8_t data[8] __attribute__(( aligned( 8 ) ));
+};
+
+typedef int(*bus_send_frame)( struct librailcan_bus* bus , const struct bus_frame* frame );
+
+/**
+ * \brief Attached to a frame when it is sent, to report when it is actually written to the bus.
+ */
+struct bus_send_tag
+{
+  void (*written)( const struct bus_send_tag* tag , uint64_t time ); //!< Called with the write time, or \c NULL if untagged.
+  struct librailcan_module* module;
+  uint64_t received; //!< Receive time of the frame this frame is a reply to.
+  uint64_t selected; //!< Time the frame content was selected.
 };
 
 struct librailcan_bus
@@ -45,21 +73,80 @@ struct librailcan_bus
       int fd;
       struct
       {
-        struct can_queue_item* front;
-        struct can_queue_item* rear;
+        struct canfd_frame* frames; //!< Ring of \c capacity frame slots, classic frames use the \c can_frame prefix.
+        struct bus_send_tag* tags; //!< Send tag per frame slot.
+        size_t capacity; //!< Always a power of two.
+        size_t front; //!< Index of the first queued frame.
+        size_t count; //!< Number of queued frames.
+        uint8_t overflow_policy;
+        size_t outputs_slot[ 256 ]; //!< Slot of the last queued OUTPUTS frame per address, only valid if it still holds that frame.
       } send_queue;
+      unsigned int cork; //!< Nesting depth of librailcan_bus_cork(), queued frames are held while non zero.
+      bool coalesce_outputs; //!< Replace queued OUTPUTS frames, \see librailcan_bus_set_output_coalescing
+      bool kernel_filter; //!< Only let frames for known modules pass the kernel \c CAN_RAW_FILTER.
+      unsigned int receive_budget; //!< Maximum number of frames read per librailcan_bus_process_poll() call, \c 0 is unlimited.
     } socketcan;
+    struct
+    {
+      struct virtual_bus* state;
+      uint64_t now; //!< Simulated time in nanoseconds.
+    } virtual;
+    struct
+    {
+      FILE* file;
+      uint64_t now; //!< Timestamp of the last replayed frame.
+    } replay;
   };
   librailcan_bus_send send;
-  struct librailcan_module** modules;
+  bus_send_frame send_frame; //!< Send a prepared frame, avoids building the frame on the reply path.
+  uint8_t frame_data_max; //!< \ref LIBRAILCAN_DATA_MAX, or \ref LIBRAILCAN_FD_DATA_MAX with CAN FD enabled.
+  struct bus_send_tag send_tag; //!< Tag for the next sent frame, set by the sender around a \c send call.
+  struct librailcan_module** modules; //!< Dense list of all modules, used for broadcast fan-out.
   size_t modules_length;
   size_t module_count;
+  struct librailcan_module* modules_by_address[ 256 ]; //!< Module lookup table, indexed by address.
   librailcan_bus_scan_callback scan_callback;
+  librailcan_bus_frame_callback frame_callback;
+  struct librailcan_timestamp rx_timestamp; //!< Receive time of the last received frame.
+  struct librailcan_bus_stats stats;
+  struct reactor_source* reactor_source; //!< Set when the bus is registered with a reactor.
+  struct io_thread* io_thread; //!< Set when the bus is served by its own I/O thread.
+  struct trace* trace; //!< Set while frames are recorded to a trace file.
+  bool realtime; //!< Real-time mode, \see librailcan_bus_set_realtime
   void* user_data;
 };
 
+/**
+ * \brief Get the current time in the clock domain of received frame timestamps.
+ *
+ * \return Nanoseconds since the epoch.
+ */
+uint64_t bus_clock( void );
+
+/**
+ * \brief Get the current time of a bus, simulated time for a virtual bus and trace time for a replay bus.
+ *
+ * \return Nanoseconds.
+ */
+static inline uint64_t bus_now( const struct librailcan_bus* bus )
+{
+  switch( bus->interface )
+  {
+    case if_virtual:
+      return bus->virtual.now;
+
+    case if_replay:
+      return bus->replay.now;
+
+    default:
+      return bus_clock();
+  }
+}
+
 int bus_open( enum bus_interface interface , struct librailcan_bus** bus );
+int bus_send_frame_generic( struct librailcan_bus* bus , const struct bus_frame* frame );
 int bus_add_module( struct librailcan_bus* bus , struct librailcan_module* module );
-void bus_received( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data );
+void bus_remove_module( struct librailcan_bus* bus , struct librailcan_module* module );
+void bus_received( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp );
 
 #endif
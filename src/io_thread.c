@@ -0,0 +1,536 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#include "io_thread.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#if defined( HAVE_PTHREAD_H ) && defined( HAVE_SYS_EVENTFD_H ) && defined( HAVE_POLL_H ) && defined( HAVE_LINUX_CAN_H )
+#  define IO_THREAD_SUPPORTED
+#  include <pthread.h>
+#  include <poll.h>
+#  include <sys/eventfd.h>
+#endif
+#include "allocator.h"
+#include "bus.h"
+#include "socketcan.h"
+#include "log.h"
+
+#ifdef IO_THREAD_SUPPORTED
+
+/**
+ * Intrusive multiple producer single consumer queue, see:
+ * http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ */
+struct io_command_queue
+{
+  struct io_command* head; //!< Last pushed command, written by producers.
+  struct io_command* tail; //!< Next command to pop, only used by the consumer.
+  struct io_command stub;
+};
+
+static __thread struct librailcan_bus* current_bus = NULL; //!< Bus served by the calling I/O thread.
+
+struct io_thread
+{
+  pthread_t thread;
+  int event_fd; //!< Wakes up the thread when a command is posted or it must stop.
+  bool stop;
+  struct io_command_queue queue;
+  unsigned int posting; //!< Number of producers between their \c exited check and their push.
+  bool exited; //!< No commands are accepted anymore.
+  int error; //!< Reason the thread exited on its own, e.g. a socket error.
+  pthread_mutex_t lock; //!< Guards io_command::done of waiting callers.
+  pthread_cond_t done; //!< Signalled when a command a caller waits for is executed.
+};
+
+static void queue_init( struct io_command_queue* queue )
+{
+  queue->stub.next = NULL;
+  queue->head = &queue->stub;
+  queue->tail = &queue->stub;
+}
+
+static void queue_push( struct io_command_queue* queue , struct io_command* command )
+{
+  __atomic_store_n( &command->next , NULL , __ATOMIC_RELAXED );
+  struct io_command* previous = __atomic_exchange_n( &queue->head , command , __ATOMIC_ACQ_REL );
+  __atomic_store_n( &previous->next , command , __ATOMIC_RELEASE );
+}
+
+static struct io_command* queue_pop( struct io_command_queue* queue )
+{
+  struct io_command* tail = queue->tail;
+  struct io_command* next = __atomic_load_n( &tail->next , __ATOMIC_ACQUIRE );
+
+  if( tail == &queue->stub )
+  {
+    if( !next )
+      return NULL;
+
+    queue->tail = next;
+    tail = next;
+    next = __atomic_load_n( &tail->next , __ATOMIC_ACQUIRE );
+  }
+
+  if( next )
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  if( tail != __atomic_load_n( &queue->head , __ATOMIC_ACQUIRE ) )
+    return NULL; // a producer is halfway a push, the command is picked up on the next wake up
+
+  queue_push( queue , &queue->stub );
+
+  next = __atomic_load_n( &tail->next , __ATOMIC_ACQUIRE );
+  if( next )
+  {
+    queue->tail = next;
+    return tail;
+  }
+
+  return NULL;
+}
+
+static int execute( struct io_command* c )
+{
+  const uintptr_t* a = c->args;
+
+  switch( c->type )
+  {
+    case io_cmd_bus_get_stats:
+      return librailcan_bus_get_stats( c->object , (struct librailcan_bus_stats*)a[0] , a[1] );
+
+    case io_cmd_bus_scan:
+      return librailcan_bus_scan( c->object , a[0] , a[1] );
+
+    case io_cmd_bus_set_scan_callback:
+      return librailcan_bus_set_scan_callback( c->object , (librailcan_bus_scan_callback)a[0] );
+
+    case io_cmd_bus_set_frame_callback:
+      return librailcan_bus_set_frame_callback( c->object , (librailcan_bus_frame_callback)a[0] );
+
+    case io_cmd_bus_set_receive_budget:
+      return librailcan_bus_set_receive_budget( c->object , a[0] );
+
+    case io_cmd_bus_set_send_queue_capacity:
+      return librailcan_bus_set_send_queue_capacity( c->object , a[0] );
+
+    case io_cmd_bus_set_send_queue_overflow_policy:
+      return librailcan_bus_set_send_queue_overflow_policy( c->object , a[0] );
+
+    case io_cmd_bus_set_kernel_filter:
+      return librailcan_bus_set_kernel_filter( c->object , a[0] );
+
+    case io_cmd_bus_set_can_fd:
+      return librailcan_bus_set_can_fd( c->object , a[0] );
+
+    case io_cmd_bus_cork:
+      return librailcan_bus_cork( c->object );
+
+    case io_cmd_bus_uncork:
+      return librailcan_bus_uncork( c->object );
+
+    case io_cmd_bus_set_output_coalescing:
+      return librailcan_bus_set_output_coalescing( c->object , a[0] );
+
+    case io_cmd_module_open:
+      return librailcan_module_open( c->object , a[0] , (struct librailcan_module**)a[1] );
+
+    case io_cmd_module_close:
+      return librailcan_module_close( c->object );
+
+    case io_cmd_module_get_active:
+      return librailcan_module_get_active( c->object , (librailcan_bool*)a[0] );
+
+    case io_cmd_module_set_active:
+      return librailcan_module_set_active( c->object , a[0] );
+
+    case io_cmd_io_read_digital_input:
+      return librailcan_io_read_digital_input( c->object , a[0] , (librailcan_tristate*)a[1] );
+
+    case io_cmd_io_set_digital_input_changed_callback:
+      return librailcan_io_set_digital_input_changed_callback( c->object , (librailcan_digital_io_changed_callback)a[0] );
+
+    case io_cmd_io_set_digital_input_bulk_changed_callback:
+      return librailcan_io_set_digital_input_bulk_changed_callback( c->object , (librailcan_digital_io_bulk_changed_callback)a[0] );
+
+    case io_cmd_io_read_digital_output:
+      return librailcan_io_read_digital_output( c->object , a[0] , (librailcan_tristate*)a[1] );
+
+    case io_cmd_io_write_digital_output:
+      return librailcan_io_write_digital_output( c->object , a[0] , a[1] );
+
+    case io_cmd_io_write_digital_outputs:
+      return librailcan_io_write_digital_outputs( c->object , (const uint64_t*)a[0] , (const uint64_t*)a[1] );
+
+    case io_cmd_io_set_digital_output_changed_callback:
+      return librailcan_io_set_digital_output_changed_callback( c->object , (librailcan_digital_io_changed_callback)a[0] );
+
+    case io_cmd_io_set_digital_output_bulk_changed_callback:
+      return librailcan_io_set_digital_output_bulk_changed_callback( c->object , (librailcan_digital_io_bulk_changed_callback)a[0] );
+
+    case io_cmd_io_set_event_ring:
+      return librailcan_io_set_event_ring( c->object , a[0] );
+
+    case io_cmd_io_set_digital_input_debounce:
+      return librailcan_io_set_digital_input_debounce( c->object , a[0] , a[1] );
+
+    case io_cmd_dcc_get_enabled:
+      return librailcan_dcc_get_enabled( c->object , (uint8_t*)a[0] );
+
+    case io_cmd_dcc_set_enabled:
+      return librailcan_dcc_set_enabled( c->object , a[0] );
+
+    case io_cmd_dcc_set_get_packet_callback:
+      return librailcan_dcc_set_get_packet_callback( c->object , (librailcan_dcc_get_packet_callback)a[0] );
+
+    case io_cmd_dcc_set_expected_locomotive_count:
+      return librailcan_dcc_set_expected_locomotive_count( c->object , a[0] );
+
+    case io_cmd_dcc_get_stats:
+      return librailcan_dcc_get_stats( c->object , (struct librailcan_dcc_stats*)a[0] , a[1] );
+
+    case io_cmd_dcc_set_reply_format:
+      return librailcan_dcc_set_reply_format( c->object , a[0] );
+
+    case io_cmd_dcc_set_scheduler:
+      return librailcan_dcc_set_scheduler( c->object , a[0] );
+
+    case io_cmd_dcc_set_refresh_interval:
+      return librailcan_dcc_set_refresh_interval( c->object , a[0] , a[1] );
+
+    case io_cmd_dcc_locomotive_emergency_stop:
+      return librailcan_dcc_locomotive_emergency_stop( c->object , a[0] );
+
+    case io_cmd_dcc_locomotive_set_speed:
+      return librailcan_dcc_locomotive_set_speed( c->object , a[0] , a[1] );
+
+    case io_cmd_dcc_locomotive_set_direction:
+      return librailcan_dcc_locomotive_set_direction( c->object , a[0] , a[1] );
+
+    case io_cmd_dcc_locomotive_set_function:
+      return librailcan_dcc_locomotive_set_function( c->object , a[0] , a[1] , a[2] );
+
+    case io_cmd_dcc_locomotive_write_cv:
+      return librailcan_dcc_locomotive_write_cv( c->object , a[0] , a[1] , a[2] );
+
+    case io_cmd_dcc_locomotive_write_cv_bit:
+      return librailcan_dcc_locomotive_write_cv_bit( c->object , a[0] , a[1] , a[2] , a[3] );
+
+    case io_cmd_dcc_basic_accessory_set_output:
+      return librailcan_dcc_basic_accessory_set_output( c->object , a[0] , a[1] , a[2] );
+
+    case io_cmd_dcc_basic_accessory_write_cv:
+      return librailcan_dcc_basic_accessory_write_cv( c->object , a[0] , (int8_t)a[1] , a[2] , a[3] );
+
+    case io_cmd_dcc_basic_accessory_write_cv_bit:
+      return librailcan_dcc_basic_accessory_write_cv_bit( c->object , a[0] , (int8_t)a[1] , a[2] , a[3] , a[4] );
+
+    case io_cmd_dcc_extended_accessory_set_state:
+      return librailcan_dcc_extended_accessory_set_state( c->object , a[0] , a[1] );
+
+    case io_cmd_dcc_extended_accessory_write_cv:
+      return librailcan_dcc_extended_accessory_write_cv( c->object , a[0] , a[1] , a[2] );
+
+    case io_cmd_dcc_extended_accessory_write_cv_bit:
+      return librailcan_dcc_extended_accessory_write_cv_bit( c->object , a[0] , a[1] , a[2] , a[3] );
+  }
+
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+}
+
+static void drain( struct io_thread* t )
+{
+  struct io_command* command;
+
+  while( ( command = queue_pop( &t->queue ) ) )
+  {
+    const int r = execute( command );
+
+    if( command->wait )
+    {
+      // The command lives on the stack of the waiting caller, don't touch it after this:
+      pthread_mutex_lock( &t->lock );
+      command->result = r;
+      command->done = true;
+      pthread_cond_broadcast( &t->done );
+      pthread_mutex_unlock( &t->lock );
+    }
+    else
+    {
+      if( r != LIBRAILCAN_STATUS_SUCCESS )
+        LOG_WARNING( "io thread: posted call %d failed: %d\n" , command->type , r );
+
+      allocator_free( command );
+    }
+  }
+}
+
+static void* run( void* arg )
+{
+  struct librailcan_bus* bus = arg;
+  struct io_thread* t = bus->io_thread;
+  int r = LIBRAILCAN_STATUS_SUCCESS;
+
+  current_bus = bus;
+
+  while( r == LIBRAILCAN_STATUS_SUCCESS && !__atomic_load_n( &t->stop , __ATOMIC_ACQUIRE ) )
+  {
+    struct pollfd fds[2] = {
+      { .fd = bus->socketcan.fd , .events = socketcan_send_pending( bus ) ? POLLIN | POLLOUT : POLLIN } ,
+      { .fd = t->event_fd , .events = POLLIN }
+    };
+
+    if( poll( fds , 2 , -1 ) == -1 )
+    {
+      if( errno == EINTR )
+        continue;
+
+      LOG_ERROR( "io thread poll: [%m]\n" );
+      r = LIBRAILCAN_STATUS_UNSUCCESSFUL;
+      break;
+    }
+
+    if( fds[1].revents & POLLIN )
+    {
+      uint64_t value;
+      if( read( t->event_fd , &value , sizeof( value ) ) != sizeof( value ) )
+        LOG_WARNING( "io thread eventfd read: [%m]\n" );
+    }
+
+    drain( t );
+
+    if( fds[0].revents & POLLOUT )
+      r = socketcan_flush( bus );
+
+    if( r == LIBRAILCAN_STATUS_SUCCESS && ( fds[0].revents & ( POLLIN | POLLERR ) ) )
+    {
+      // Read in small slices, so posted calls are applied between frames:
+      do
+      {
+        const size_t count = bus->stats.frames_received + bus->stats.frames_dropped;
+
+        if( ( r = socketcan_receive( bus , IO_THREAD_RECEIVE_BUDGET ) ) != LIBRAILCAN_STATUS_SUCCESS )
+          break; // peer closed the socket or the interface is gone
+
+        drain( t );
+
+        if( bus->stats.frames_received + bus->stats.frames_dropped - count < IO_THREAD_RECEIVE_BUDGET ) // socket drained
+          break;
+      }
+      while( !__atomic_load_n( &t->stop , __ATOMIC_ACQUIRE ) );
+    }
+    else if( r == LIBRAILCAN_STATUS_SUCCESS && ( fds[0].revents & ( POLLHUP | POLLNVAL ) ) )
+    {
+      LOG_ERROR( "io thread: socket hung up\n" );
+      r = LIBRAILCAN_STATUS_UNSUCCESSFUL;
+    }
+
+    if( r == LIBRAILCAN_STATUS_SUCCESS && socketcan_send_pending( bus ) )
+      r = socketcan_flush( bus );
+  }
+
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    LOG_ERROR( "io thread stopped: %d\n" , r );
+
+  // Refuse new commands, the ones being pushed right now are executed by the last drain:
+  t->error = r;
+  __atomic_store_n( &t->exited , true , __ATOMIC_SEQ_CST );
+  while( __atomic_load_n( &t->posting , __ATOMIC_SEQ_CST ) > 0 )
+    sched_yield();
+
+  drain( t );
+
+  return NULL;
+}
+
+#endif
+
+bool io_thread_is_foreign( struct librailcan_bus* bus )
+{
+#ifdef IO_THREAD_SUPPORTED
+  return bus->io_thread && current_bus != bus;
+#else
+  return false;
+#endif
+}
+
+#ifdef IO_THREAD_SUPPORTED
+static int push( struct io_thread* t , struct io_command* command )
+{
+  // Lock-free, pairs with the exited store and posting load at the end of run():
+  __atomic_add_fetch( &t->posting , 1 , __ATOMIC_SEQ_CST );
+
+  const bool exited = __atomic_load_n( &t->exited , __ATOMIC_SEQ_CST );
+  if( !exited )
+    queue_push( &t->queue , command );
+
+  __atomic_sub_fetch( &t->posting , 1 , __ATOMIC_SEQ_CST );
+
+  if( exited )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  const uint64_t one = 1;
+  if( write( t->event_fd , &one , sizeof( one ) ) != sizeof( one ) )
+    LOG_WARNING( "io thread eventfd write: [%m]\n" );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+#endif
+
+int io_thread_post( struct librailcan_bus* bus , enum io_command_type type , void* object , uintptr_t a0 , uintptr_t a1 , uintptr_t a2 , uintptr_t a3 , uintptr_t a4 )
+{
+#ifdef IO_THREAD_SUPPORTED
+  struct io_thread* t = bus->io_thread;
+  struct io_command command = {
+    .type = type ,
+    .object = object ,
+    .args = { a0 , a1 , a2 , a3 , a4 } ,
+    .wait = true ,
+    .done = false
+  };
+
+  int r = push( t , &command );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  pthread_mutex_lock( &t->lock );
+  while( !command.done )
+    pthread_cond_wait( &t->done , &t->lock );
+  pthread_mutex_unlock( &t->lock );
+
+  return command.result;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int io_thread_post_async( struct librailcan_bus* bus , enum io_command_type type , void* object , uintptr_t a0 , uintptr_t a1 , uintptr_t a2 , uintptr_t a3 , uintptr_t a4 )
+{
+#ifdef IO_THREAD_SUPPORTED
+  struct io_command* command = allocator_malloc( sizeof( *command ) );
+  if( !command )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  *command = (struct io_command){
+    .type = type ,
+    .object = object ,
+    .args = { a0 , a1 , a2 , a3 , a4 } ,
+    .wait = false
+  };
+
+  int r = push( bus->io_thread , command );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    allocator_free( command );
+
+  return r;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int io_thread_stop( struct librailcan_bus* bus )
+{
+#ifdef IO_THREAD_SUPPORTED
+  struct io_thread* t = bus->io_thread;
+
+  if( !t )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  __atomic_store_n( &t->stop , true , __ATOMIC_RELEASE );
+
+  const uint64_t one = 1;
+  if( write( t->event_fd , &one , sizeof( one ) ) != sizeof( one ) )
+    LOG_WARNING( "io thread eventfd write: [%m]\n" );
+
+  pthread_join( t->thread , NULL );
+
+  const int r = t->error;
+
+  close( t->event_fd );
+  pthread_cond_destroy( &t->done );
+  pthread_mutex_destroy( &t->lock );
+  allocator_free( t );
+
+  bus->io_thread = NULL;
+
+  return r;
+#else
+  return LIBRAILCAN_STATUS_SUCCESS;
+#endif
+}
+
+int librailcan_bus_start_io_thread( struct librailcan_bus* bus )
+{
+#ifdef IO_THREAD_SUPPORTED
+  if( !bus || bus->io_thread || bus->reactor_source )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct io_thread* t = allocator_calloc( 1 , sizeof( *t ) );
+  if( !t )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  queue_init( &t->queue );
+  pthread_mutex_init( &t->lock , NULL );
+  pthread_cond_init( &t->done , NULL );
+
+  t->event_fd = eventfd( 0 , EFD_NONBLOCK | EFD_CLOEXEC );
+  if( t->event_fd == -1 )
+  {
+    LOG_ERROR( "eventfd: [%m]\n" );
+    pthread_cond_destroy( &t->done );
+    pthread_mutex_destroy( &t->lock );
+    allocator_free( t );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  bus->io_thread = t;
+
+  if( pthread_create( &t->thread , NULL , run , bus ) != 0 )
+  {
+    LOG_ERROR( "pthread_create failed\n" );
+    bus->io_thread = NULL;
+    close( t->event_fd );
+    pthread_cond_destroy( &t->done );
+    pthread_mutex_destroy( &t->lock );
+    allocator_free( t );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_bus_stop_io_thread( struct librailcan_bus* bus )
+{
+  if( !bus || !bus->io_thread || !io_thread_is_foreign( bus ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  return io_thread_stop( bus );
+}
@@ -0,0 +1,131 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef _IO_THREAD_H_
+#define _IO_THREAD_H_
+
+#include <stdbool.h>
+#include "librailcan.h"
+
+#define IO_THREAD_RECEIVE_BUDGET  8 //!< Number of frames read between two command queue drains.
+
+enum io_command_type
+{
+  io_cmd_bus_get_stats ,
+  io_cmd_bus_scan ,
+  io_cmd_bus_set_scan_callback ,
+  io_cmd_bus_set_frame_callback ,
+  io_cmd_bus_set_receive_budget ,
+  io_cmd_bus_set_send_queue_capacity ,
+  io_cmd_bus_set_send_queue_overflow_policy ,
+  io_cmd_bus_set_kernel_filter ,
+  io_cmd_bus_set_can_fd ,
+  io_cmd_bus_cork ,
+  io_cmd_bus_uncork ,
+  io_cmd_bus_set_output_coalescing ,
+  io_cmd_module_open ,
+  io_cmd_module_close ,
+  io_cmd_module_get_active ,
+  io_cmd_module_set_active ,
+  io_cmd_io_read_digital_input ,
+  io_cmd_io_set_digital_input_changed_callback ,
+  io_cmd_io_set_digital_input_bulk_changed_callback ,
+  io_cmd_io_read_digital_output ,
+  io_cmd_io_write_digital_output ,
+  io_cmd_io_write_digital_outputs ,
+  io_cmd_io_set_digital_output_changed_callback ,
+  io_cmd_io_set_digital_output_bulk_changed_callback ,
+  io_cmd_io_set_event_ring ,
+  io_cmd_io_set_digital_input_debounce ,
+  io_cmd_dcc_get_enabled ,
+  io_cmd_dcc_set_enabled ,
+  io_cmd_dcc_set_get_packet_callback ,
+  io_cmd_dcc_set_expected_locomotive_count ,
+  io_cmd_dcc_get_stats ,
+  io_cmd_dcc_set_reply_format ,
+  io_cmd_dcc_set_scheduler ,
+  io_cmd_dcc_set_refresh_interval ,
+  io_cmd_dcc_locomotive_emergency_stop ,
+  io_cmd_dcc_locomotive_set_speed ,
+  io_cmd_dcc_locomotive_set_direction ,
+  io_cmd_dcc_locomotive_set_function ,
+  io_cmd_dcc_locomotive_write_cv ,
+  io_cmd_dcc_locomotive_write_cv_bit ,
+  io_cmd_dcc_basic_accessory_set_output ,
+  io_cmd_dcc_basic_accessory_write_cv ,
+  io_cmd_dcc_basic_accessory_write_cv_bit ,
+  io_cmd_dcc_extended_accessory_set_state ,
+  io_cmd_dcc_extended_accessory_write_cv ,
+  io_cmd_dcc_extended_accessory_write_cv_bit
+};
+
+struct io_command
+{
+  struct io_command* next;
+  enum io_command_type type;
+  void* object; //!< Module or bus handle.
+  uintptr_t args[ 5 ];
+  bool wait; //!< The caller waits for \c result, else the I/O thread frees the command after executing it.
+  int result;
+  bool done; //!< Set by the I/O thread once \c result is valid, guarded by the I/O thread lock.
+};
+
+/**
+ * \brief Check if the caller must post the API call to the bus I/O thread.
+ *
+ * \return \c true if the bus has an I/O thread and the caller is not that thread.
+ */
+bool io_thread_is_foreign( struct librailcan_bus* bus );
+
+/**
+ * \brief Post an API call to the bus I/O thread and wait for it.
+ *
+ * The call is executed by the I/O thread between received frames.
+ *
+ * \return Result of the call.
+ */
+int io_thread_post( struct librailcan_bus* bus , enum io_command_type type , void* object , uintptr_t a0 , uintptr_t a1 , uintptr_t a2 , uintptr_t a3 , uintptr_t a4 );
+
+/**
+ * \brief Post an API call to the bus I/O thread without waiting for it.
+ *
+ * For calls whose parameters are validated before posting, errors while executing the call are only logged.
+ *
+ * \return #LIBRAILCAN_STATUS_SUCCESS if the call is queued.
+ */
+int io_thread_post_async( struct librailcan_bus* bus , enum io_command_type type , void* object , uintptr_t a0 , uintptr_t a1 , uintptr_t a2 , uintptr_t a3 , uintptr_t a4 );
+
+#define IO_THREAD_POST( bus , type , object , a0 , a1 , a2 , a3 , a4 ) \
+  if( io_thread_is_foreign( bus ) ) \
+    return io_thread_post( bus , type , object , (uintptr_t)(a0) , (uintptr_t)(a1) , (uintptr_t)(a2) , (uintptr_t)(a3) , (uintptr_t)(a4) )
+
+#define IO_THREAD_POST_ASYNC( bus , type , object , a0 , a1 , a2 , a3 , a4 ) \
+  if( io_thread_is_foreign( bus ) ) \
+    return io_thread_post_async( bus , type , object , (uintptr_t)(a0) , (uintptr_t)(a1) , (uintptr_t)(a2) , (uintptr_t)(a3) , (uintptr_t)(a4) )
+
+/**
+ * \brief Stop and free the I/O thread of a bus, if any.
+ *
+ * \return Error that made the thread exit on its own, or #LIBRAILCAN_STATUS_SUCCESS.
+ */
+int io_thread_stop( struct librailcan_bus* bus );
+
+#endif
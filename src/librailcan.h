@@ -41,6 +41,7 @@ extern "C" {
 #define LIBRAILCAN_STATUS_INVALID_PARAM  -4
 #define LIBRAILCAN_STATUS_INVALID_INDEX  -5
 #define LIBRAILCAN_STATUS_NOT_ACTIVE     -6
+#define LIBRAILCAN_STATUS_BUFFER_FULL    -7
 
 #define LIBRAILCAN_DEBUGLEVEL_NONE     0
 #define LIBRAILCAN_DEBUGLEVEL_ERROR    1
@@ -61,6 +62,46 @@ typedef uint8_t librailcan_bool;
  */
 int librailcan_set_debug_level( int level );
 
+/**
+ * \brief Memory allocation functions, all library memory is allocated through these.
+ *
+ * The functions are called from the I/O thread too, if one is used.
+ */
+struct librailcan_allocator
+{
+  void* (*malloc)( size_t size , void* user_data );
+  void* (*calloc)( size_t count , size_t size , void* user_data );
+  void* (*realloc)( void* ptr , size_t size , void* user_data );
+  void (*free)( void* ptr , void* user_data );
+  void* user_data; //!< Passed to every call.
+};
+
+struct librailcan_allocation_stats
+{
+  size_t allocations; //!< Number of allocations, resizes not included.
+  size_t frees;
+  size_t realtime_allocations; //!< Number of allocations and resizes while a bus was in real-time mode. \see librailcan_bus_set_realtime
+};
+
+/**
+ * \brief Replace the memory allocation functions.
+ *
+ * Only possible while no library memory is allocated, i.e. before the first bus is opened or after all are closed.
+ *
+ * \param[in] allocator allocation functions, or \c NULL to restore the C library functions
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_set_allocator( const struct librailcan_allocator* allocator );
+
+/**
+ * \brief Get allocation statistics.
+ *
+ * \param[out] stats receives the statistics
+ * \param[in] stats_size size of \a stats in bytes
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_get_allocation_stats( struct librailcan_allocation_stats* stats , size_t stats_size );
+
 /**
  * \defgroup version Version
  * \{
@@ -96,10 +137,36 @@ const struct librailcan_version* librailcan_get_protocol_version( void );
 
 #define LIBRAILCAN_DLC_RTR  -1
 
+#define LIBRAILCAN_DATA_MAX     8 //!< Maximum payload of a classic CAN frame.
+#define LIBRAILCAN_FD_DATA_MAX  64 //!< Maximum payload of a CAN FD frame. \see librailcan_bus_set_can_fd
+
+#define LIBRAILCAN_SEND_QUEUE_OVERFLOW_REJECT  0 //!< Reject frames with #LIBRAILCAN_STATUS_BUFFER_FULL when the send queue is full.
+#define LIBRAILCAN_SEND_QUEUE_OVERFLOW_GROW    1 //!< Double the send queue capacity when it is full (default).
+
 struct librailcan_bus;
 
+struct librailcan_bus_stats
+{
+  size_t send_queue_capacity;
+  size_t send_queue_count;
+  size_t send_queue_high_water; //!< Highest number of frames queued at once.
+  size_t send_queue_overflows; //!< Number of frames rejected because the send queue was full.
+  size_t send_queue_grows; //!< Number of times the send queue capacity was doubled.
+  size_t frames_sent;
+  size_t frames_received;
+  size_t frames_coalesced; //!< Number of queued OUTPUTS frames replaced by a newer one.
+  size_t frames_dropped; //!< Number of received messages that weren't a CAN or CAN FD frame, or were an extended frame.
+};
+
 typedef int(*librailcan_bus_send)( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data );
+struct librailcan_timestamp
+{
+  uint64_t software; //!< Kernel receive time in nanoseconds since the epoch, or the time the library read the frame.
+  uint64_t hardware; //!< Raw hardware receive time in nanoseconds, or \c 0 if not available.
+};
+
 typedef int(*librailcan_bus_scan_callback)( struct librailcan_bus* bus , uint8_t address , uint8_t type );
+typedef void(*librailcan_bus_frame_callback)( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp );
 
 int librailcan_bus_open_custom( librailcan_bus_send send , struct librailcan_bus** bus );
 
@@ -112,9 +179,25 @@ int librailcan_bus_open_custom( librailcan_bus_send send , struct librailcan_bus
  */
 int librailcan_bus_open_socketcan( const char* interface , struct librailcan_bus** bus );
 
+/**
+ * \brief Open a RailCAN bus on an already opened socket.
+ *
+ * \a fd must be a bound \c CAN_RAW socket, or a socket with the same datagram semantics carrying
+ * \c struct \c can_frame, e.g. one end of an \c AF_UNIX \c SOCK_SEQPACKET socket pair. The socket is switched to
+ * non-blocking mode, the bus takes ownership of \a fd on success.
+ *
+ * \param[in] fd socket file descriptor
+ * \param[out] bus ...
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_open_socketcan_fd( int fd , struct librailcan_bus** bus );
+
 /**
  * \brief ...
  *
+ * Must not be called from a callback of the bus itself, e.g. while librailcan_bus_process() or librailcan_reactor_run()
+ * handles its frames. Removing the bus from a reactor in such a callback is allowed.
+ *
  * \param[in] bus a bus handle
  * \return \ref librailcan_status "Status code".
  */
@@ -156,12 +239,156 @@ int librailcan_bus_process_poll( struct librailcan_bus* bus , short revents );
  */
 int librailcan_bus_process( struct librailcan_bus* bus , int timeout );
 
+/**
+ * \brief Limit the number of frames read per librailcan_bus_process_poll() call.
+ *
+ * When the budget is used up the remaining frames stay in the socket and are read by the next call,
+ * so one busy bus cannot starve the rest of an event loop.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] frames maximum number of frames, or \c 0 for no limit (default)
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_receive_budget( struct librailcan_bus* bus , unsigned int frames );
+
+/**
+ * \brief Set the number of frame slots in the send queue.
+ *
+ * The send queue is a preallocated ring, sending a frame does not allocate memory unless the queue overflows.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] capacity number of frames, rounded up to a power of two
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_send_queue_capacity( struct librailcan_bus* bus , size_t capacity );
+
+/**
+ * \brief Select what happens when a frame is sent while the send queue is full.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] policy #LIBRAILCAN_SEND_QUEUE_OVERFLOW_REJECT or #LIBRAILCAN_SEND_QUEUE_OVERFLOW_GROW
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_send_queue_overflow_policy( struct librailcan_bus* bus , uint8_t policy );
+
+/**
+ * \brief Hold sent frames in the send queue until librailcan_bus_uncork().
+ *
+ * While corked an OUTPUTS frame replaces the queued OUTPUTS frame of the same module, so a module touched several times
+ * results in a single frame with its latest output state. Calls can be nested.
+ *
+ * \param[in] bus a bus handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_cork( struct librailcan_bus* bus );
+
+/**
+ * \brief Release a librailcan_bus_cork(), the queued frames are written in one batch when the last cork is released.
+ *
+ * \param[in] bus a bus handle
+ * \return \ref librailcan_status "Status code", #LIBRAILCAN_STATUS_UNSUCCESSFUL if the bus isn't corked.
+ */
+int librailcan_bus_uncork( struct librailcan_bus* bus );
+
+/**
+ * \brief Enable or disable OUTPUTS frame coalescing without explicit corking.
+ *
+ * Frames are written by the next librailcan_bus_process() call (or the reactor or I/O thread), when enabled an OUTPUTS
+ * frame that is still queued is replaced by a newer one of the same module. All output changes made between two
+ * process calls end up in one frame per module.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] enabled #LIBRAILCAN_BOOL_TRUE or #LIBRAILCAN_BOOL_FALSE (default)
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_output_coalescing( struct librailcan_bus* bus , librailcan_bool enabled );
+
+/**
+ * \brief Enable or disable kernel side filtering of received frames.
+ *
+ * When enabled the SocketCAN \c CAN_RAW_FILTER list is rebuilt from the known modules whenever a module is discovered or
+ * removed, so frames of other nodes on a shared CAN segment are dropped by the kernel.
+ * INFO messages are always passed, so librailcan_bus_scan() keeps working.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] enabled #LIBRAILCAN_BOOL_TRUE or #LIBRAILCAN_BOOL_FALSE (default)
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_kernel_filter( struct librailcan_bus* bus , librailcan_bool enabled );
+
+/**
+ * \brief Enable or disable CAN FD frames.
+ *
+ * With CAN FD enabled frames carry up to #LIBRAILCAN_FD_DATA_MAX bytes, IO modules can report large banks in one frame
+ * and DCC modules using the packed reply format receive up to #LIBRAILCAN_FD_DATA_MAX / 3 packets per frame.
+ * Payloads longer than #LIBRAILCAN_DATA_MAX are sent as FD frames, padded with zeros to the next valid FD length.
+ * For a SocketCAN bus the interface must have the CAN FD MTU, for a custom bus the send callback must accept the longer
+ * frames. CAN FD can't be disabled on a SocketCAN bus while FD frames are queued, retry once the send queue
+ * has drained.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] enabled #LIBRAILCAN_BOOL_TRUE or #LIBRAILCAN_BOOL_FALSE (default)
+ * \return \ref librailcan_status "Status code", \ref LIBRAILCAN_STATUS_UNSUCCESSFUL if FD frames are still queued.
+ */
+int librailcan_bus_set_can_fd( struct librailcan_bus* bus , librailcan_bool enabled );
+
+/**
+ * \brief Let the library serve the bus from its own I/O thread.
+ *
+ * While the I/O thread runs, calls that change library state (set speed, write outputs, etc.) may be made from any
+ * thread. Calls from other threads are pushed to a lock-free queue and applied by the I/O thread between received
+ * frames. Locomotive and accessory setters and callback setters return once their parameters are validated and the call
+ * is queued, failures while applying them are logged. Other calls wait for the I/O thread and return its result, so
+ * don't make them from another thread while holding a lock a callback needs: callbacks are called from the I/O thread.
+ * librailcan_bus_process() and librailcan_bus_process_poll() must not be used.
+ *
+ * \param[in] bus a SocketCAN bus handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_start_io_thread( struct librailcan_bus* bus );
+
+/**
+ * \brief Stop the I/O thread of a bus.
+ *
+ * Calls posted before are applied before the thread exits. Calls from other threads must not overlap with stopping.
+ * The thread exits on its own on a socket error, e.g. when the peer closes the socket or the interface goes away; calls
+ * from other threads then return #LIBRAILCAN_STATUS_UNSUCCESSFUL.
+ *
+ * \param[in] bus a bus handle
+ * \return \ref librailcan_status "Status code", the error that made the thread exit if it did so on its own.
+ */
+int librailcan_bus_stop_io_thread( struct librailcan_bus* bus );
+
+/**
+ * \brief Enable or disable real-time mode.
+ *
+ * Enabling preallocates the module table, the send queue and the DCC packet storage of all modules for their expected
+ * locomotive count (see librailcan_dcc_set_expected_locomotive_count()), so the control loop doesn't allocate.
+ * Allocations that happen anyway while a bus is in real-time mode are counted in
+ * librailcan_allocation_stats::realtime_allocations. Modules found later still allocate.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] enabled ...
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_realtime( struct librailcan_bus* bus , librailcan_bool enabled );
+
+/**
+ * \brief Get bus statistics.
+ *
+ * \param[in] bus a bus handle
+ * \param[out] stats receives the statistics
+ * \param[in] stats_size size of \a stats in bytes
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_get_stats( struct librailcan_bus* bus , struct librailcan_bus_stats* stats , size_t stats_size );
+
 /**
  * \brief ...
  *
  * \param[in] bus a bus handle
  * \param[in] id
- * \param[in] dlc data lenght \c 0..8 or #LIBRAILCAN_DLC_RTR.
+ * \param[in] dlc data lenght \c 0..8, \c 0..64 if CAN FD is enabled, or #LIBRAILCAN_DLC_RTR.
  * \param[in] data
  * \return \ref librailcan_status "Status code".
  */
@@ -186,6 +413,27 @@ int librailcan_bus_scan( struct librailcan_bus* bus , uint8_t start , uint8_t en
  */
 int librailcan_bus_set_scan_callback( struct librailcan_bus* bus , librailcan_bus_scan_callback callback );
 
+/**
+ * \brief Set a hook that is called for every received frame, before it is dispatched to the modules.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] callback pointer to callback function or \c NULL to disable.
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_set_frame_callback( struct librailcan_bus* bus , librailcan_bus_frame_callback callback );
+
+/**
+ * \brief Get the receive timestamp of the last received frame.
+ *
+ * Called from a module callback this is the timestamp of the frame that caused the callback.
+ * SocketCAN buses use \c SO_TIMESTAMPING, software and hardware timestamps are reported when the driver supports them.
+ *
+ * \param[in] bus a bus handle
+ * \param[out] timestamp ...
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_get_rx_timestamp( struct librailcan_bus* bus , struct librailcan_timestamp* timestamp );
+
 /**
  * \brief Get user supplied bus data.
  *
@@ -204,6 +452,257 @@ int librailcan_bus_get_user_data( struct librailcan_bus* bus , void** data );
  */
 int librailcan_bus_set_user_data( struct librailcan_bus* bus , void* data );
 
+/**
+ * \}
+ * \defgroup trace Trace and replay
+ * \{
+ *   \brief Record received and sent frames to a compact binary trace file and feed them back later.
+ */
+
+/**
+ * \brief Record all received and sent frames with their timestamps.
+ *
+ * Records are appended to \a path, a new file is created if it doesn't exist. On a SocketCAN bus sent frames are
+ * recorded when they are written to the socket, frames replaced by coalescing are not recorded. Must be called before
+ * the I/O thread is started.
+ *
+ * \param[in] bus a bus handle
+ * \param[in] path trace file name
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_start_trace( struct librailcan_bus* bus , const char* path );
+
+/**
+ * \brief Stop recording and close the trace file.
+ *
+ * \param[in] bus a bus handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_stop_trace( struct librailcan_bus* bus );
+
+/**
+ * \brief Convert a trace file to the \c candump \c -l log format, which can be played back with \c canplayer.
+ *
+ * \param[in] path trace file name
+ * \param[in] output_path log file name
+ * \param[in] interface interface name written to the log, e.g. \c can0
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_trace_export_candump( const char* path , const char* output_path , const char* interface );
+
+/**
+ * \brief Open a bus that replays the received frames of a trace file.
+ *
+ * Frames sent by the library are accepted and discarded.
+ *
+ * \param[in] path trace file name
+ * \param[out] bus ...
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_open_replay( const char* path , struct librailcan_bus** bus );
+
+/**
+ * \brief Replay the received frames of the trace.
+ *
+ * Frames are passed with their original timestamps, the bus time follows the trace, so a replay is deterministic.
+ *
+ * \param[in] bus a replay bus handle
+ * \param[in] speed \c 1 for the original timing, \c N to run \c N times faster, \c 0 to replay as fast as possible
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_replay_run( struct librailcan_bus* bus , unsigned int speed );
+
+/**
+ * \}
+ * \defgroup reactor Reactor
+ * \{
+ *   \brief Drive many buses, file descriptors and timers from one thread using \c epoll.
+ */
+
+struct librailcan_reactor;
+
+typedef void(*librailcan_reactor_fd_callback)( struct librailcan_reactor* reactor , int fd , short revents , void* user_data );
+typedef void(*librailcan_reactor_timer_callback)( struct librailcan_reactor* reactor , int timer , void* user_data );
+
+/**
+ * \brief Create a reactor.
+ *
+ * \param[out] reactor ...
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_create( struct librailcan_reactor** reactor );
+
+/**
+ * \brief Destroy a reactor.
+ *
+ * Registered buses are removed from the reactor, but not closed. Timers are deleted.
+ *
+ * \param[in] reactor a reactor handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_destroy( struct librailcan_reactor* reactor );
+
+/**
+ * \brief Register a bus.
+ *
+ * The bus is always watched for received frames, \c EPOLLOUT is only enabled while its send queue is not empty.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] bus a SocketCAN bus handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_add_bus( struct librailcan_reactor* reactor , struct librailcan_bus* bus );
+
+/**
+ * \brief Unregister a bus.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] bus a bus handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_remove_bus( struct librailcan_reactor* reactor , struct librailcan_bus* bus );
+
+/**
+ * \brief Limit the number of frames read from one bus per librailcan_reactor_run() call.
+ *
+ * A bus with more pending frames stays ready and is served again after the other ready buses.
+ * A lower budget set by librailcan_bus_set_receive_budget() takes precedence.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] frames maximum number of frames, or \c 0 for no limit
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_set_bus_budget( struct librailcan_reactor* reactor , unsigned int frames );
+
+/**
+ * \brief Register a user file descriptor.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] fd file descriptor
+ * \param[in] events \c poll() events to watch, e.g. \c POLLIN
+ * \param[in] callback function called with the returned events
+ * \param[in] user_data passed to \a callback
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_add_fd( struct librailcan_reactor* reactor , int fd , short events , librailcan_reactor_fd_callback callback , void* user_data );
+
+/**
+ * \brief Unregister a user file descriptor.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] fd file descriptor
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_remove_fd( struct librailcan_reactor* reactor , int fd );
+
+/**
+ * \brief Add a periodic timer.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] interval interval in milliseconds
+ * \param[in] callback function called when the timer expires
+ * \param[in] user_data passed to \a callback
+ * \param[out] timer timer handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_add_timer( struct librailcan_reactor* reactor , unsigned int interval , librailcan_reactor_timer_callback callback , void* user_data , int* timer );
+
+/**
+ * \brief Remove a timer.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] timer timer handle
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_remove_timer( struct librailcan_reactor* reactor , int timer );
+
+/**
+ * \brief Wait for events and dispatch them.
+ *
+ * \param[in] reactor a reactor handle
+ * \param[in] timeout timeout in milliseconds, or negative if you want to wait forever
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_reactor_run( struct librailcan_reactor* reactor , int timeout );
+
+/**
+ * \}
+ * \defgroup virtual Virtual bus
+ * \{
+ *
+ * An in-process simulated RailCAN bus with IO and DCC nodes, for testing and benchmarking without hardware.
+ * Time only advances inside librailcan_virtual_run(), frames are timed at the configured CAN bit rate
+ * including arbitration and worst case bit stuffing.
+ */
+
+struct librailcan_virtual_stats
+{
+  uint64_t time; //!< Simulated time in nanoseconds.
+  uint64_t bus_busy_time; //!< Time the CAN bus was transmitting in nanoseconds.
+  size_t frames; //!< Number of frames transmitted.
+  size_t host_frames; //!< Number of frames sent by the library.
+  size_t node_frames; //!< Number of frames sent by the simulated nodes.
+  size_t node_queue_overflows; //!< Number of node frames dropped because the node transmit queue was full.
+  size_t dcc_packets; //!< Number of DCC packets put on the track.
+  size_t dcc_fill_packets; //!< Number of idle packets the command station inserted because no packet arrived in time.
+  size_t dcc_invalid_packets; //!< Number of invalid DCC replies.
+  uint64_t dcc_line_busy_time; //!< Time the DCC track signal was busy in nanoseconds.
+  size_t io_output_frames; //!< Number of OUTPUTS frames received by IO nodes.
+  size_t io_input_changes; //!< Number of generated input changes.
+};
+
+/**
+ * \brief Open a virtual RailCAN bus.
+ *
+ * \param[in] bitrate simulated CAN bit rate in bit/s, e.g. \c 125000
+ * \param[out] bus ...
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_bus_open_virtual( uint32_t bitrate , struct librailcan_bus** bus );
+
+/**
+ * \brief Add a simulated IO node.
+ *
+ * \param[in] bus a virtual bus handle
+ * \param[in] address node address
+ * \param[in] input_count number of digital inputs
+ * \param[in] output_count number of digital outputs
+ * \param[in] input_change_interval time between random input changes in microseconds, \c 0 to keep the inputs constant
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_virtual_add_io_node( struct librailcan_bus* bus , uint8_t address , uint8_t input_count , uint8_t output_count , uint32_t input_change_interval );
+
+/**
+ * \brief Add a simulated DCC command station.
+ *
+ * The node requests the next packet with an RTR as soon as the previous one starts on the track, and inserts
+ * idle packets when no reply arrives in time.
+ *
+ * \param[in] bus a virtual bus handle
+ * \param[in] address node address
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_virtual_add_dcc_node( struct librailcan_bus* bus , uint8_t address );
+
+/**
+ * \brief Run the simulation.
+ *
+ * \param[in] bus a virtual bus handle
+ * \param[in] duration simulated time to run in nanoseconds
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_virtual_run( struct librailcan_bus* bus , uint64_t duration );
+
+/**
+ * \brief Get virtual bus statistics.
+ *
+ * \param[in] bus a virtual bus handle
+ * \param[out] stats receives the statistics
+ * \param[in] stats_size size of \a stats in bytes
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_virtual_get_stats( struct librailcan_bus* bus , struct librailcan_virtual_stats* stats , size_t stats_size );
+
 /**
  * \}
  * \defgroup module Module
@@ -301,6 +800,18 @@ typedef uint8_t librailcan_tristate;
 
 typedef void(*librailcan_digital_io_changed_callback)( struct librailcan_module* module , unsigned int index , librailcan_tristate value );
 
+/**
+ * \brief Called once per received frame that changes one or more IO's.
+ *
+ * Bit \c i of word \c i/64 belongs to IO \c i, bitmaps hold \c (count+63)/64 words.
+ *
+ * \param[in] module a module handle
+ * \param[in] changed bitmap of IO's that changed
+ * \param[in] values bitmap of IO values, undefined IO's read as \c 0
+ * \param[in] count number of IO's
+ */
+typedef void(*librailcan_digital_io_bulk_changed_callback)( struct librailcan_module* module , const uint64_t* changed , const uint64_t* values , unsigned int count );
+
 /**
  * \brief Get number of digital inputs.
  *
@@ -329,6 +840,17 @@ int librailcan_io_read_digital_input( struct librailcan_module* module , unsigne
  */
 int librailcan_io_set_digital_input_changed_callback( struct librailcan_module* module , librailcan_digital_io_changed_callback callback );
 
+/**
+ * \brief Set callback reporting all digital input changes of a frame at once.
+ *
+ * Can be used next to or instead of the per input callback.
+ *
+ * \param[in] module a module handle
+ * \param[in] callback pointer to callback function or \c NULL to disable.
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_io_set_digital_input_bulk_changed_callback( struct librailcan_module* module , librailcan_digital_io_bulk_changed_callback callback );
+
 /**
  * \brief Get number of digital outputs.
  *
@@ -358,6 +880,19 @@ int librailcan_io_read_digital_output( struct librailcan_module* module , unsign
  */
 int librailcan_io_write_digital_output( struct librailcan_module* module , unsigned int index , librailcan_tristate value );
 
+/**
+ * \brief Change multiple digital outputs at once.
+ *
+ * All changes are sent in a single frame, the output state is only updated when that frame is accepted.
+ * Bit \c i of word \c i/64 belongs to output \c i, bitmaps hold \c (count+63)/64 words.
+ *
+ * \param[in] module a module handle
+ * \param[in] mask bitmap of outputs to change
+ * \param[in] values bitmap of new output values, only bits set in \p mask are used
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_io_write_digital_outputs( struct librailcan_module* module , const uint64_t* mask , const uint64_t* values );
+
 /**
  * \brief ...
  *
@@ -367,6 +902,67 @@ int librailcan_io_write_digital_output( struct librailcan_module* module , unsig
  */
 int librailcan_io_set_digital_output_changed_callback( struct librailcan_module* module , librailcan_digital_io_changed_callback callback );
 
+/**
+ * \brief Set callback reporting all digital output changes of a frame at once.
+ *
+ * \param[in] module a module handle
+ * \param[in] callback pointer to callback function or \c NULL to disable.
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_io_set_digital_output_bulk_changed_callback( struct librailcan_module* module , librailcan_digital_io_bulk_changed_callback callback );
+
+/**
+ * \brief Digital input change, \see librailcan_io_read_events
+ */
+struct librailcan_io_event
+{
+  uint64_t timestamp; //!< Receive time in nanoseconds of the frame with the change, \see librailcan_timestamp::software
+  uint32_t sequence; //!< Increments by one per event, a gap means events were dropped because the ring was full.
+  uint16_t index; //!< Digital input index.
+  librailcan_tristate value;
+};
+
+/**
+ * \brief Enable or disable the digital input event ring of a module.
+ *
+ * Input changes are queued with their receive time, so they can be read from another thread with
+ * librailcan_io_read_events() without locking. An enabled ring can't be resized, disable it first. Disabling the ring
+ * frees it and drops the queued events: the thread reading events must have stopped calling
+ * librailcan_io_read_events() before, the same applies to closing the module.
+ *
+ * \param[in] module a module handle
+ * \param[in] capacity number of events, rounded up to a power of two, \c 0 disables the ring
+ * \return \ref librailcan_status "Status code", #LIBRAILCAN_STATUS_UNSUCCESSFUL if the ring is already enabled.
+ */
+int librailcan_io_set_event_ring( struct librailcan_module* module , size_t capacity );
+
+/**
+ * \brief Read queued digital input events.
+ *
+ * The ring has a single consumer: call this from one thread only, which may differ from the thread processing the bus.
+ *
+ * \param[in] module a module handle
+ * \param[out] events receives the events, oldest first
+ * \param[in] count size of \a events
+ * \param[out] read number of events read
+ * \return \ref librailcan_status "Status code", #LIBRAILCAN_STATUS_UNSUCCESSFUL if the event ring isn't enabled.
+ */
+int librailcan_io_read_events( struct librailcan_module* module , struct librailcan_io_event* events , size_t count , size_t* read );
+
+/**
+ * \brief Set the software debounce time of a digital input.
+ *
+ * A change is only queued in the event ring once the input kept its new value for \a time, shorter pulses are
+ * dropped. The event carries the receive time of the first frame with the new value. Stability is checked when input
+ * frames of the module are received. The input state and changed callbacks are not debounced.
+ *
+ * \param[in] module a module handle
+ * \param[in] index digital input index
+ * \param[in] time debounce time in microseconds, \c 0 disables debounce
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_io_set_digital_input_debounce( struct librailcan_module* module , unsigned int index , uint32_t time );
+
 /**
  * \}
  * \defgroup module_dcc DCC
@@ -375,6 +971,17 @@ int librailcan_io_set_digital_output_changed_callback( struct librailcan_module*
 
 typedef void(*librailcan_dcc_get_packet_callback)( struct librailcan_module* module , const void** data , uint8_t* length );
 
+#define LIBRAILCAN_LATENCY_BUCKETS  32 //!< Bucket \c 0 counts latencies below 1 us, bucket \c i counts latencies in [ 2^(9+i) , 2^(10+i) ) ns.
+
+struct librailcan_latency_histogram
+{
+  size_t count;
+  uint64_t p50; //!< Median in nanoseconds, upper bound of the bucket.
+  uint64_t p99; //!< 99th percentile in nanoseconds, upper bound of the bucket.
+  uint64_t max; //!< Maximum in nanoseconds.
+  size_t buckets[ LIBRAILCAN_LATENCY_BUCKETS ];
+};
+
 struct librailcan_dcc_stats
 {
   size_t total_packets_sent;
@@ -386,6 +993,16 @@ struct librailcan_dcc_stats
   size_t priority_queue_packet_count;
   size_t queue_packet_count;
   size_t list_packet_count;
+  struct librailcan_latency_histogram rtr_to_select_latency; //!< RTR received until reply packet selected.
+  struct librailcan_latency_histogram select_to_write_latency; //!< Reply packet selected until frame written to the socket.
+  struct librailcan_latency_histogram rtr_to_write_latency; //!< RTR received until reply frame written to the socket.
+  size_t packet_pool_capacity; //!< Number of packet objects in the pool.
+  size_t packet_pool_used; //!< Number of packet objects in use.
+  size_t packet_pool_high_water; //!< Highest \c packet_pool_used seen.
+  size_t packet_pool_slabs; //!< Number of slabs the pool grew to.
+  uint64_t refresh_interval_max; //!< Worst case time between two refreshes of the same packet in nanoseconds.
+  size_t refresh_deadline_misses; //!< Number of refreshes sent later than the refresh interval of the packet type.
+  size_t packed_frames_sent; //!< Number of frames that carried more than one DCC packet.
 };
 
 int librailcan_dcc_get_enabled( struct librailcan_module* module , uint8_t* value );
@@ -401,6 +1018,80 @@ int librailcan_dcc_set_enabled( struct librailcan_module* module , uint8_t value
  */
 int librailcan_dcc_set_get_packet_callback( struct librailcan_module* module , librailcan_dcc_get_packet_callback callback );
 
+#define LIBRAILCAN_DCC_REPLY_FORMAT_SINGLE  0 //!< One DCC packet per frame. \see librailcan_dcc_set_reply_format
+#define LIBRAILCAN_DCC_REPLY_FORMAT_PACKED  1 //!< Length prefixed DCC packets, as many as fit in a frame. \see librailcan_dcc_set_reply_format
+
+/**
+ * \brief Select the format of the frames answering the module's requests.
+ *
+ * The packed format is only available if the module advertises it with a reply formats byte following the info in its
+ * INFO message. A packed frame holds two or more length prefixed packets, as many as fit in a frame of the bus (see
+ * librailcan_bus_set_can_fd()), taken from the priority queue and the refresh
+ * queue in the order they would have been sent one by one. It is always longer than a single DCC packet, so the module
+ * tells both formats apart by the frame length: a reply that fits only one packet is sent as a single packet frame.
+ * Reset, idle and user callback packets are always sent alone.
+ *
+ * \param[in] module a module handle
+ * \param[in] format \ref LIBRAILCAN_DCC_REPLY_FORMAT_SINGLE (default) or \ref LIBRAILCAN_DCC_REPLY_FORMAT_PACKED
+ * \return \ref librailcan_status "Status code", \ref LIBRAILCAN_STATUS_NOT_SUPPORTED if the module doesn't support the format.
+ */
+int librailcan_dcc_set_reply_format( struct librailcan_module* module , uint8_t format );
+
+#define LIBRAILCAN_DCC_SCHEDULER_ROUND_ROBIN        0 //!< Rotate the refresh queue once per packet, changed packets go to the front. \see librailcan_dcc_set_scheduler
+#define LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE  1 //!< Send the refresh packet with the earliest deadline first. \see librailcan_dcc_set_scheduler
+
+#define LIBRAILCAN_DCC_PACKET_SPEED_AND_DIRECTION  0 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_F0_F4                1 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_F5_F8                2 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_F9_F12               3 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_F13_F20              4 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_F21_F28              5 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_BASIC_ACCESSORY      6 //!< \see librailcan_dcc_set_refresh_interval
+#define LIBRAILCAN_DCC_PACKET_EXTENDED_ACCESSORY   7 //!< \see librailcan_dcc_set_refresh_interval
+
+/**
+ * \brief Select the refresh scheduler.
+ *
+ * The earliest deadline first scheduler records when each packet was last sent and picks the packet whose refresh
+ * interval expires first. Changed packets get the current time as deadline, so they can't starve overdue packets.
+ *
+ * \param[in] module a module handle
+ * \param[in] scheduler \ref LIBRAILCAN_DCC_SCHEDULER_ROUND_ROBIN (default) or \ref LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_dcc_set_scheduler( struct librailcan_module* module , uint8_t scheduler );
+
+/**
+ * \brief Set the refresh interval of a packet type.
+ *
+ * \param[in] module a module handle
+ * \param[in] packet_type one of the LIBRAILCAN_DCC_PACKET_* constants
+ * \param[in] interval refresh interval in microseconds, \c 0 restores the default
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_dcc_set_refresh_interval( struct librailcan_module* module , uint8_t packet_type , uint32_t interval );
+
+/**
+ * \brief Preallocate DCC packet objects for an expected number of locomotives.
+ *
+ * Packets are taken from a per module pool, when the pool is exhausted it grows by another slab of this size.
+ *
+ * \param[in] module a module handle
+ * \param[in] count expected number of locomotives
+ * \return \ref librailcan_status "Status code".
+ */
+int librailcan_dcc_set_expected_locomotive_count( struct librailcan_module* module , size_t count );
+
+/**
+ * \brief Get DCC statistics.
+ *
+ * Callers built against an older, smaller struct librailcan_dcc_stats get the members they know about.
+ *
+ * \param[in] module a module handle
+ * \param[out] stats receives the statistics
+ * \param[in] stats_size size of \a stats in bytes
+ * \return \ref librailcan_status "Status code".
+ */
 int librailcan_dcc_get_stats( struct librailcan_module* module , struct librailcan_dcc_stats* stats , size_t stats_size );
 
 /**
@@ -21,17 +21,20 @@
 
 #include "module.h"
 #include <stdlib.h>
+#include "allocator.h"
 #include "module_dcc.h"
 #include "module_io.h"
 #include "bus.h"
+#include "io_thread.h"
 #include "log.h"
 
-int module_init( struct librailcan_module* module , const railcan_message_info_t* info )
+int module_init( struct librailcan_module* module , const railcan_message_info_t* info , int8_t dlc )
 {
   module->type = info->node_type;
   module->free = module_free;
   module->open = module_open;
   module->close = module_close;
+  module->reserve = module_reserve;
   module->received = module_received;
 
   switch( module->type )
@@ -41,7 +44,7 @@ int module_init( struct librailcan_module* module , const railcan_message_info_t
       break;
 
     case LIBRAILCAN_MODULETYPE_DCC:
-      module_dcc_init( module , info );
+      module_dcc_init( module , info , dlc );
       break;
 
     default:
@@ -64,13 +67,20 @@ void module_close( struct librailcan_module* module )
   module->is_open = false;
 }
 
+int module_reserve( struct librailcan_module* module )
+{
+  (void)module;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
 void module_free( struct librailcan_module* module )
 {
-  //bus_module_remove( module );
-  free( module );
+  bus_remove_module( module->bus , module );
+  allocator_free( module );
 }
 
-void module_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data )
+void module_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp )
 {
 }
 
@@ -79,18 +89,20 @@ int librailcan_module_open( struct librailcan_bus* bus , uint8_t address , struc
   if( !bus || address < RAILCAN_SID_ADDRESS_FIRST || address > RAILCAN_SID_ADDRESS_LAST || !module )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
-  for( int i = 0 ; i < bus->module_count ; i++ )
-    if( bus->modules[ i ]->address == address && !bus->modules[ i ]->is_open )
-    {
-      int r = bus->modules[ i ]->open( bus->modules[ i ] );
-      if( r == LIBRAILCAN_STATUS_SUCCESS )
-        *module = bus->modules[ i ];
-      else
-        bus->modules[ i ]->close( bus->modules[ i ] );
-      return r;
-    }
-
-  return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  IO_THREAD_POST( bus , io_cmd_module_open , bus , address , module , 0 , 0 , 0 );
+
+  struct librailcan_module* m = bus->modules_by_address[ address ];
+
+  if( !m || m->is_open )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  int r = m->open( m );
+  if( r == LIBRAILCAN_STATUS_SUCCESS )
+    *module = m;
+  else
+    m->close( m );
+
+  return r;
 }
 
 int librailcan_module_close( struct librailcan_module* module )
@@ -98,10 +110,11 @@ int librailcan_module_close( struct librailcan_module* module )
   if( !module )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST( module->bus , io_cmd_module_close , module , 0 , 0 , 0 , 0 , 0 );
+
   module->close( module );
 
   return LIBRAILCAN_STATUS_SUCCESS;
-
 }
 
 int librailcan_module_get_bus( struct librailcan_module* module , struct librailcan_bus** bus )
@@ -129,6 +142,8 @@ int librailcan_module_get_active( struct librailcan_module* module , librailcan_
   if( !module || !value )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST( module->bus , io_cmd_module_get_active , module , value , 0 , 0 , 0 , 0 );
+
   *value = module->is_active ? LIBRAILCAN_BOOL_TRUE : LIBRAILCAN_BOOL_FALSE;
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -139,6 +154,8 @@ int librailcan_module_set_active( struct librailcan_module* module , librailcan_
   if( !module || value > LIBRAILCAN_BOOL_TRUE )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST( module->bus , io_cmd_module_set_active , module , value , 0 , 0 , 0 , 0 );
+
   module->is_active = ( value == LIBRAILCAN_BOOL_TRUE );
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -37,14 +37,16 @@ struct librailcan_module
   void (*free)( struct librailcan_module* module );
   int (*open)( struct librailcan_module* module );
   void (*close)( struct librailcan_module* module );
-  void (*received)( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data );
+  int (*reserve)( struct librailcan_module* module ); //!< Preallocate for real-time mode.
+  void (*received)( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp );
   void* user_data;
 };
 
-int module_init( struct librailcan_module* module , const railcan_message_info_t* info );
+int module_init( struct librailcan_module* module , const railcan_message_info_t* info , int8_t dlc );
 void module_free( struct librailcan_module* module );
 int module_open( struct librailcan_module* module );
 void module_close( struct librailcan_module* module );
-void module_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data );
+int module_reserve( struct librailcan_module* module );
+void module_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp );
 
 #endif
\ No newline at end of file
@@ -21,25 +21,51 @@
 
 #include "module_dcc.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include "allocator.h"
 #include "bus.h"
+#include "io_thread.h"
 #include "module_dcc_packet.h"
 
-int module_dcc_init( struct librailcan_module* module , const railcan_message_info_t* info )
+static void init_frames( struct librailcan_module* module )
 {
-  struct module_dcc* dcc = calloc( 1 , sizeof( *dcc ) );
+  struct module_dcc* dcc = module->private_data;
+  const uint32_t id = RAILCAN_SID( RAILCAN_SID_MESSAGE_DCC , module->address );
+
+  dcc->reset_frame = (struct bus_frame){ .id = id , .dlc = 2 , .data = { 0x00 , 0x00 } };
+  dcc->idle_frame = (struct bus_frame){ .id = id , .dlc = 2 , .data = { 0xff , 0x00 } };
+}
+
+int module_dcc_init( struct librailcan_module* module , const railcan_message_info_t* info , int8_t dlc )
+{
+  struct module_dcc* dcc = allocator_calloc( 1 , sizeof( *dcc ) );
   if( !dcc )
     return LIBRAILCAN_STATUS_NO_MEMORY;
 
   module->private_data = dcc;
   module->free = module_dcc_free;
+  module->close = module_dcc_close;
+  module->reserve = module_dcc_reserve;
   module->received = module_dcc_received;
 
+  dcc->reply_formats = 1 << LIBRAILCAN_DCC_REPLY_FORMAT_SINGLE;
+  if( dlc > (int)DCC_INFO_REPLY_FORMATS_OFFSET )
+    dcc->reply_formats |= ((const uint8_t*)info)[ DCC_INFO_REPLY_FORMATS_OFFSET ];
+
+  init_frames( module );
+
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
 void module_dcc_free( struct librailcan_module* module )
 {
-  free( module->private_data );
+  struct module_dcc* dcc = module->private_data;
+
+  module_dcc_packet_pool_release( module );
+  allocator_free( dcc->packet_list.items );
+  allocator_free( dcc->packet_list.index );
+  allocator_free( dcc->refresh_heap.items );
+  allocator_free( dcc );
 
   module_free( module );
 }
@@ -48,23 +74,186 @@ void module_dcc_close( struct librailcan_module* module )
 {
   struct module_dcc* dcc = module->private_data;
 
-  while( dcc->packet_priority_queue )
+  // All packets live in the pool, returning every slot to it empties the list and both queues:
+  struct dcc_packet_slab* slabs = dcc->packet_pool.slabs;
+  const size_t expected_locomotives = dcc->packet_pool.expected_locomotives;
+  const size_t capacity = dcc->stats.packet_pool_capacity;
+  const size_t count = dcc->stats.packet_pool_slabs;
+  const uint8_t reply_formats = dcc->reply_formats;
+  struct dcc_packet** items = dcc->packet_list.items;
+  struct dcc_packet** index = dcc->packet_list.index;
+  const size_t length = dcc->packet_list.length;
+  const size_t index_length = dcc->packet_list.index_length;
+  struct dcc_packet** heap_items = dcc->refresh_heap.items;
+  const size_t heap_length = dcc->refresh_heap.length;
+
+  memset( dcc , 0 , sizeof( *dcc ) ); // Reset everything.
+
+  // Keep the pool, list and heap allocated for a next open, with all packets free:
+  dcc->packet_pool.slabs = slabs;
+  dcc->packet_pool.expected_locomotives = expected_locomotives;
+  dcc->stats.packet_pool_capacity = capacity;
+  dcc->stats.packet_pool_slabs = count;
+  dcc->reply_formats = reply_formats;
+  dcc->packet_list.items = items;
+  dcc->packet_list.index = index;
+  dcc->packet_list.length = length;
+  dcc->packet_list.index_length = index_length;
+  dcc->refresh_heap.items = heap_items;
+  dcc->refresh_heap.length = heap_length;
+
+  if( index )
+    memset( index , 0 , index_length * sizeof( *index ) );
+
+  init_frames( module );
+
+  for( struct dcc_packet_slab* slab = slabs ; slab ; slab = slab->next )
+    for( size_t i = slab->length ; i-- > 0 ; )
+    {
+      slab->packets[ i ].next = dcc->packet_pool.free_list;
+      dcc->packet_pool.free_list = &slab->packets[ i ];
+    }
+
+  module_close( module );
+}
+
+int module_dcc_reserve( struct librailcan_module* module )
+{
+  struct module_dcc* dcc = module->private_data;
+  const size_t expected = dcc->packet_pool.expected_locomotives ? dcc->packet_pool.expected_locomotives : DCC_EXPECTED_LOCOMOTIVES_DEFAULT;
+
+  return module_dcc_packet_pool_reserve( module , expected * DCC_PACKETS_PER_LOCOMOTIVE );
+}
+
+static void latency_add( struct librailcan_latency_histogram* histogram , uint64_t begin , uint64_t end )
+{
+  const uint64_t latency = ( end > begin ) ? end - begin : 0;
+  int bucket = ( latency > 0 ) ? 63 - __builtin_clzll( latency ) - 9 : 0;
+
+  if( bucket < 0 )
+    bucket = 0;
+  else if( bucket >= LIBRAILCAN_LATENCY_BUCKETS )
+    bucket = LIBRAILCAN_LATENCY_BUCKETS - 1;
+
+  histogram->buckets[ bucket ]++;
+  histogram->count++;
+
+  if( latency > histogram->max )
+    histogram->max = latency;
+}
+
+static uint64_t latency_percentile( const struct librailcan_latency_histogram* histogram , unsigned int percentile )
+{
+  if( histogram->count == 0 )
+    return 0;
+
+  const size_t rank = ( histogram->count * percentile + 99 ) / 100;
+  size_t n = 0;
+
+  for( int i = 0 ; i < LIBRAILCAN_LATENCY_BUCKETS ; i++ )
+    if( ( n += histogram->buckets[ i ] ) >= rank )
+    {
+      const uint64_t upper = 1ULL << ( 10 + i );
+      return upper < histogram->max ? upper : histogram->max;
+    }
+
+  return histogram->max;
+}
+
+static void latency_update_percentiles( struct librailcan_latency_histogram* histogram )
+{
+  histogram->p50 = latency_percentile( histogram , 50 );
+  histogram->p99 = latency_percentile( histogram , 99 );
+}
+
+static void module_dcc_written( const struct bus_send_tag* tag , uint64_t time )
+{
+  struct module_dcc* dcc = tag->module->private_data;
+
+  latency_add( &dcc->stats.select_to_write_latency , tag->selected , time );
+  latency_add( &dcc->stats.rtr_to_write_latency , tag->received , time );
+}
+
+enum dcc_release
+{
+  dcc_keep ,
+  dcc_free , //!< Expired packet from the priority queue.
+  dcc_delete //!< Expired packet in the refresh queue and list.
+};
+
+struct dcc_taken
+{
+  struct dcc_packet* packet;
+  enum dcc_release release; //!< Applied after the frame is sent.
+};
+
+/**
+ * \brief Next packet to send from the priority queue or refresh queue.
+ */
+static struct dcc_packet* peek_packet( struct module_dcc* dcc )
+{
+  if( dcc->packet_priority_queue )
+    return dcc->packet_priority_queue;
+  else if( !dcc->packet_queue )
+    return NULL;
+  else if( dcc->scheduler == LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+    return dcc->refresh_heap.items[0];
+  else
+    return dcc->packet_queue;
+}
+
+/**
+ * \brief Account a peeked packet as sent.
+ */
+static void take_packet( struct librailcan_module* module , struct dcc_packet* packet , struct dcc_taken* taken )
+{
+  struct module_dcc* dcc = module->private_data;
+
+  taken->packet = packet;
+  taken->release = dcc_keep;
+
+  dcc->stats.total_packets_sent++;
+
+  if( packet == dcc->packet_priority_queue )
   {
-    struct dcc_packet* packet = dcc->packet_priority_queue;
-    dcc->packet_priority_queue = packet->next;
-    free( packet );
+    if( --packet->ttl <= 0 )
+    {
+      dcc->packet_priority_queue = packet->next;
+      dcc->stats.priority_queue_packet_count--;
+      taken->release = dcc_free;
+    }
+
+    dcc->stats.priority_queue_packets_sent++;
   }
+  else
+  {
+    if( dcc->scheduler != LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+      dcc->packet_queue = packet->next;
 
-  for( int i = 0 ; i < dcc->packet_list.count ; i++ )
-    free( dcc->packet_list.items[i] );
-  free( dcc->packet_list.items );
+    module_dcc_packet_queue_sent( module , packet , bus_now( module->bus ) );
 
-  memset( dcc , 0 , sizeof( *dcc ) ); // Reset everything.
+    if( packet->ttl > 0 && --packet->ttl == 0 )
+    {
+      if( packet->remove )
+        taken->release = dcc_delete;
+      else
+        module_dcc_packet_queue_remove( module , packet );
+    }
 
-  module_close( module );
+    dcc->stats.queue_packets_sent++;
+  }
 }
 
-void module_dcc_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data )
+static bool is_taken( const struct dcc_taken* taken , size_t count , const struct dcc_packet* packet )
+{
+  for( size_t i = 0 ; i < count ; i++ )
+    if( taken[ i ].packet == packet )
+      return true;
+
+  return false;
+}
+
+void module_dcc_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp )
 {
   switch( RAILCAN_SID_TO_MESSAGE( id ) )
   {
@@ -75,76 +264,111 @@ void module_dcc_received( struct librailcan_module* module , uint32_t id , int8_
 
       struct module_dcc* dcc = module->private_data;
 
-      const void* dcc_data = NULL;
-      uint8_t length = 0;
-
-      dcc->stats.total_packets_sent++;
+      const struct bus_frame* frame;
+      struct bus_frame user_frame;
+      struct dcc_packet* packet;
+      struct dcc_taken taken[ DCC_PACKETS_PER_FRAME_MAX ];
+      size_t taken_count = 0;
+      uint8_t packed[ LIBRAILCAN_FD_DATA_MAX ];
+      uint8_t packed_length = 0;
 
       if( !dcc->enabled ) // reset packet
       {
-        static const uint8_t dcc_reset[] = { 0x00 , 0x00 };
-        dcc_data = dcc_reset;
-        length = sizeof( dcc_reset );
+        frame = &dcc->reset_frame;
 
+        dcc->stats.total_packets_sent++;
         dcc->stats.reset_packets_sent++;
       }
       else if( dcc->get_packet_callback )
       {
-        dcc->get_packet_callback( module , &dcc_data , &length );
+        const void* data = NULL;
+        uint8_t length = 0;
+
+        dcc->get_packet_callback( module , &data , &length );
 
+        user_frame.id = id;
+        user_frame.dlc = length;
+        if( length > 0 && length <= 8 )
+          memcpy( user_frame.data , data , length );
+        frame = &user_frame;
+
+        dcc->stats.total_packets_sent++;
         dcc->stats.user_packets_sent++;
       }
-      else if( dcc->packet_priority_queue )
+      else if( ( packet = peek_packet( dcc ) ) )
       {
-        struct dcc_packet* packet = dcc->packet_priority_queue;
-
-        dcc_data = packet->data;
-        length = packet->data_length;
+        frame = &packet->frame;
+        take_packet( module , packet , &taken[ taken_count++ ] );
 
-        if( --packet->ttl <= 0 )
+        if( dcc->reply_format == LIBRAILCAN_DCC_REPLY_FORMAT_PACKED )
         {
-          dcc->packet_priority_queue = packet->next;
-          dcc->stats.priority_queue_packet_count--;
-          free( packet );
+          // Length prefixed packets in scheduler order, as many distinct packets as fit, with CAN FD a whole window:
+          struct dcc_packet* next = peek_packet( dcc );
+
+          if( next && !is_taken( taken , taken_count , next ) && 2 + frame->dlc + next->frame.dlc <= module->bus->frame_data_max )
+          {
+            packed[ packed_length++ ] = frame->dlc;
+            memcpy( packed + packed_length , frame->data , frame->dlc );
+            packed_length += frame->dlc;
+
+            while( next && !is_taken( taken , taken_count , next ) &&
+                   taken_count < DCC_PACKETS_PER_FRAME_MAX &&
+                   packed_length + 1 + next->frame.dlc <= module->bus->frame_data_max )
+            {
+              packed[ packed_length++ ] = next->frame.dlc;
+              memcpy( packed + packed_length , next->frame.data , next->frame.dlc );
+              packed_length += next->frame.dlc;
+
+              take_packet( module , next , &taken[ taken_count++ ] );
+              next = peek_packet( dcc );
+            }
+
+            dcc->stats.packed_frames_sent++;
+          }
         }
-
-        dcc->stats.priority_queue_packets_sent++;
       }
-      else if( dcc->packet_queue )
+      else // idle packet
       {
-        struct dcc_packet* packet = dcc->packet_queue;
+        frame = &dcc->idle_frame;
 
-        dcc_data = packet->data;
-        length = packet->data_length;
+        dcc->stats.total_packets_sent++;
+        dcc->stats.idle_packets_sent++;
+      }
 
-        dcc->packet_queue = packet->next;
+      const uint64_t selected = bus_now( module->bus );
 
-        if( packet->ttl > 0 && --packet->ttl == 0 )
-        {
-          if( packet->remove )
-            module_dcc_packet_delete( module , packet );
-          else
-            module_dcc_packet_queue_remove( module , packet );
-        }
+      latency_add( &dcc->stats.rtr_to_select_latency , timestamp->software , selected );
 
-        dcc->stats.queue_packets_sent++;
-      }
-      else // idle packet
+      if( packed_length > 0 || ( frame->dlc > 0 && frame->dlc <= 8 ) )
       {
-        static const uint8_t dcc_idle[] = { 0xff , 0x00 };
-        dcc_data = dcc_idle;
-        length = sizeof( dcc_idle );
+        struct librailcan_bus* bus = module->bus;
 
-        dcc->stats.idle_packets_sent++;
+        bus->send_tag.written = module_dcc_written;
+        bus->send_tag.module = module;
+        bus->send_tag.received = timestamp->software;
+        bus->send_tag.selected = selected;
+
+        int r = packed_length > 0 ? bus->send( bus , id , packed_length , packed ) : bus->send_frame( bus , frame );
+
+        memset( &bus->send_tag , 0 , sizeof( bus->send_tag ) );
+
+        if( r == LIBRAILCAN_STATUS_SUCCESS && bus->interface != if_socketcan ) // custom bus, written by send
+          module_dcc_written( &(struct bus_send_tag){ .module = module , .received = timestamp->software , .selected = selected } , bus_now( module->bus ) );
       }
 
-      if( length > 0 && length <= 8 )
-        module->bus->send( module->bus , id , length , dcc_data );
+      // Release expired packets only after their frame is sent:
+      for( size_t i = 0 ; i < taken_count ; i++ )
+      {
+        if( taken[ i ].release == dcc_delete )
+          module_dcc_packet_delete( module , taken[ i ].packet );
+        else if( taken[ i ].release == dcc_free )
+          module_dcc_packet_free( module , taken[ i ].packet );
+      }
 
       break;
     }
     default:
-      module_received( module , id , dlc , data );
+      module_received( module , id , dlc , data , timestamp );
   }
 }
 
@@ -155,6 +379,8 @@ int librailcan_dcc_get_enabled( struct librailcan_module* module , uint8_t* valu
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_get_enabled , module , value , 0 , 0 , 0 , 0 );
+
   *value = ((struct module_dcc*)module->private_data)->enabled;
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -167,6 +393,8 @@ int librailcan_dcc_set_enabled( struct librailcan_module* module , uint8_t value
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_set_enabled , module , value , 0 , 0 , 0 , 0 );
+
   ((struct module_dcc*)module->private_data)->enabled = value;
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -179,19 +407,122 @@ int librailcan_dcc_set_get_packet_callback( struct librailcan_module* module , l
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_set_get_packet_callback , module , callback , 0 , 0 , 0 , 0 );
+
   ((struct module_dcc*)module->private_data)->get_packet_callback = callback;
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
+int librailcan_dcc_set_reply_format( struct librailcan_module* module , uint8_t format )
+{
+  if( !module || format > LIBRAILCAN_DCC_REPLY_FORMAT_PACKED )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( module->bus , io_cmd_dcc_set_reply_format , module , format , 0 , 0 , 0 , 0 );
+
+  struct module_dcc* dcc = module->private_data;
+
+  if( !( dcc->reply_formats & ( 1 << format ) ) )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  dcc->reply_format = format;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_dcc_set_scheduler( struct librailcan_module* module , uint8_t scheduler )
+{
+  if( !module || scheduler > LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( module->bus , io_cmd_dcc_set_scheduler , module , scheduler , 0 , 0 , 0 , 0 );
+
+  struct module_dcc* dcc = module->private_data;
+
+  if( scheduler == dcc->scheduler )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  if( scheduler == LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+  {
+    int r = module_dcc_refresh_heap_build( module );
+    if( r != LIBRAILCAN_STATUS_SUCCESS )
+      return r;
+  }
+  else
+    dcc->refresh_heap.count = 0;
+
+  dcc->scheduler = scheduler;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_dcc_set_refresh_interval( struct librailcan_module* module , uint8_t packet_type , uint32_t interval )
+{
+  static const enum dcc_packet_type types[][2] = {
+    [ LIBRAILCAN_DCC_PACKET_SPEED_AND_DIRECTION ] = { dcc_speed_and_direction , dcc_speed_and_direction } ,
+    [ LIBRAILCAN_DCC_PACKET_F0_F4 ] = { dcc_f0_f4 , dcc_f0_f4 } ,
+    [ LIBRAILCAN_DCC_PACKET_F5_F8 ] = { dcc_f5_f8 , dcc_f5_f8 } ,
+    [ LIBRAILCAN_DCC_PACKET_F9_F12 ] = { dcc_f9_f12 , dcc_f9_f12 } ,
+    [ LIBRAILCAN_DCC_PACKET_F13_F20 ] = { dcc_f13_f20 , dcc_f13_f20 } ,
+    [ LIBRAILCAN_DCC_PACKET_F21_F28 ] = { dcc_f21_f28 , dcc_f21_f28 } ,
+    [ LIBRAILCAN_DCC_PACKET_BASIC_ACCESSORY ] = { dcc_basic_accessory , dcc_basic_accessory_disposable } ,
+    [ LIBRAILCAN_DCC_PACKET_EXTENDED_ACCESSORY ] = { dcc_extended_accessory , dcc_extended_accessory_disposable } ,
+  };
+
+  if( !module || packet_type >= sizeof( types ) / sizeof( types[0] ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( module->bus , io_cmd_dcc_set_refresh_interval , module , packet_type , interval , 0 , 0 , 0 );
+
+  struct module_dcc* dcc = module->private_data;
+
+  dcc->refresh_interval[ types[ packet_type ][0] ] = (uint64_t)interval * 1000;
+  dcc->refresh_interval[ types[ packet_type ][1] ] = (uint64_t)interval * 1000;
+
+  if( dcc->scheduler == LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+    return module_dcc_refresh_heap_build( module ); // update deadlines
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_dcc_set_expected_locomotive_count( struct librailcan_module* module , size_t count )
+{
+  if( !module || count == 0 )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( module->bus , io_cmd_dcc_set_expected_locomotive_count , module , count , 0 , 0 , 0 , 0 );
+
+  ((struct module_dcc*)module->private_data)->packet_pool.expected_locomotives = count;
+
+  return module_dcc_packet_pool_reserve( module , count * DCC_PACKETS_PER_LOCOMOTIVE );
+}
+
 int librailcan_dcc_get_stats( struct librailcan_module* module , struct librailcan_dcc_stats* stats , size_t stats_size )
 {
-  if( !module || !stats || stats_size < sizeof( *stats ) )
+  if( !module || !stats || stats_size < offsetof( struct librailcan_dcc_stats , rtr_to_select_latency ) )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
-  memcpy( stats , &((struct module_dcc*)module->private_data)->stats , sizeof( *stats ) );
+  IO_THREAD_POST( module->bus , io_cmd_dcc_get_stats , module , stats , stats_size , 0 , 0 , 0 );
+
+  // Percentiles are computed in a copy, the module's histograms are only written by the thread serving the bus:
+  struct librailcan_dcc_stats copy = ((struct module_dcc*)module->private_data)->stats;
+
+  latency_update_percentiles( &copy.rtr_to_select_latency );
+  latency_update_percentiles( &copy.select_to_write_latency );
+  latency_update_percentiles( &copy.rtr_to_write_latency );
+
+  memcpy( stats , &copy , stats_size < sizeof( *stats ) ? stats_size : sizeof( *stats ) );
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
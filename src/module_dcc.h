@@ -24,9 +24,10 @@
 
 #include "module.h"
 
-int module_dcc_init( struct librailcan_module* module , const railcan_message_info_t* info );
+int module_dcc_init( struct librailcan_module* module , const railcan_message_info_t* info , int8_t dlc );
 void module_dcc_free( struct librailcan_module* module );
 void module_dcc_close( struct librailcan_module* module );
-void module_dcc_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data );
+int module_dcc_reserve( struct librailcan_module* module );
+void module_dcc_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp );
 
 #endif
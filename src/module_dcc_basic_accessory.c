@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include "module.h"
 #include "module_dcc_packet.h"
+#include "io_thread.h"
 
 #define MODULE_DCC_BASIC_ACCESSORY_OUTPUT_INDEX_MAX  7
 
@@ -37,6 +38,8 @@ int librailcan_dcc_basic_accessory_set_output( struct librailcan_module* module
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_basic_accessory_set_output , module , address , index , value , 0 , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -48,9 +51,9 @@ int librailcan_dcc_basic_accessory_set_output( struct librailcan_module* module
     return r;
 
   if( value == LIBRAILCAN_DCC_BASIC_ACCESSORY_OUTPUT_ON )
-    packet->data[ 1 ] |= 0x08;
+    packet->frame.data[ 1 ] |= 0x08;
   else
-    packet->data[ 1 ] &= ~0x08;
+    packet->frame.data[ 1 ] &= ~0x08;
 
   module_dcc_packet_update_ttl_and_flags( packet );
 
@@ -67,7 +70,7 @@ static bool is_valid_index( int8_t index )
 static void set_index( struct dcc_packet* packet , int8_t index )
 {
   if( index > -1 )
-    packet->data[ packet->data_length - 1 ] |= 0x8 | index;
+    packet->frame.data[ packet->frame.dlc - 1 ] |= 0x8 | index;
 }
 
 int librailcan_dcc_basic_accessory_write_cv( struct librailcan_module* module , uint16_t address , int8_t index , uint16_t cv , uint8_t value )
@@ -77,6 +80,8 @@ int librailcan_dcc_basic_accessory_write_cv( struct librailcan_module* module ,
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_basic_accessory_write_cv , module , address , index , cv , value , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -87,7 +92,7 @@ int librailcan_dcc_basic_accessory_write_cv( struct librailcan_module* module ,
 
   if( ( r = module_dcc_write_cv( module , packet , cv , value ) ) != LIBRAILCAN_STATUS_SUCCESS )
   {
-    free( packet );
+    module_dcc_packet_free( module , packet );
     return r;
   }
 
@@ -101,6 +106,8 @@ int librailcan_dcc_basic_accessory_write_cv_bit( struct librailcan_module* modul
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_basic_accessory_write_cv_bit , module , address , index , cv , bit , value );
+
   struct dcc_packet* packet;
   int r;
 
@@ -111,7 +118,7 @@ int librailcan_dcc_basic_accessory_write_cv_bit( struct librailcan_module* modul
 
   if( ( r = module_dcc_write_cv_bit( module , packet , cv , bit , value ) ) != LIBRAILCAN_STATUS_SUCCESS )
   {
-    free( packet );
+    module_dcc_packet_free( module , packet );
     return r;
   }
 
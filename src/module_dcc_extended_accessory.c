@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include "module.h"
 #include "module_dcc_packet.h"
+#include "io_thread.h"
 
 static bool is_valid_address( uint16_t address )
 {
@@ -35,6 +36,8 @@ int librailcan_dcc_extended_accessory_set_state( struct librailcan_module* modul
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_extended_accessory_set_state , module , address , value , 0 , 0 , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -43,7 +46,7 @@ int librailcan_dcc_extended_accessory_set_state( struct librailcan_module* modul
   else if( !packet && ( r = module_dcc_packet_create( module , address , dcc_extended_accessory , &packet ) ) != LIBRAILCAN_STATUS_SUCCESS )
     return r;
 
-  packet->data[ 2 ] = value;
+  packet->frame.data[ 2 ] = value;
 
   module_dcc_packet_update_ttl_and_flags( packet );
 
@@ -59,6 +62,8 @@ int librailcan_dcc_extended_accessory_write_cv( struct librailcan_module* module
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_extended_accessory_write_cv , module , address , cv , value , 0 , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -67,7 +72,7 @@ int librailcan_dcc_extended_accessory_write_cv( struct librailcan_module* module
 
   if( ( r = module_dcc_write_cv( module , packet , cv , value ) ) != LIBRAILCAN_STATUS_SUCCESS )
   {
-    free( packet );
+    module_dcc_packet_free( module , packet );
     return r;
   }
 
@@ -81,6 +86,8 @@ int librailcan_dcc_extended_accessory_write_cv_bit( struct librailcan_module* mo
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_extended_accessory_write_cv_bit , module , address , cv , bit , value , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -89,7 +96,7 @@ int librailcan_dcc_extended_accessory_write_cv_bit( struct librailcan_module* mo
 
   if( ( r = module_dcc_write_cv_bit( module , packet , cv , bit , value ) ) != LIBRAILCAN_STATUS_SUCCESS )
   {
-    free( packet );
+    module_dcc_packet_free( module , packet );
     return r;
   }
 
@@ -22,6 +22,7 @@
 #include "module.h"
 #include <stdlib.h>
 #include "module_dcc_packet.h"
+#include "io_thread.h"
 
 #define MODULE_DCC_LOCOMOTIVE_FUNCTION_INDEX_MAX  28
 
@@ -40,6 +41,8 @@ int librailcan_dcc_locomotive_emergency_stop( struct librailcan_module* module ,
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_locomotive_emergency_stop , module , address , 0 , 0 , 0 , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -60,14 +63,6 @@ int librailcan_dcc_locomotive_set_speed( struct librailcan_module* module , uint
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
-  struct dcc_packet* packet;
-  int r;
-
-  if( ( r = module_dcc_packet_list_get( module , address , dcc_speed_and_direction , &packet ) ) != LIBRAILCAN_STATUS_SUCCESS )
-    return r;
-  else if( !packet && ( r = module_dcc_packet_create( module , address , dcc_speed_and_direction , &packet ) ) != LIBRAILCAN_STATUS_SUCCESS )
-    return r;
-
   int8_t speed;
   enum dcc_speed_steps speed_steps;
 
@@ -92,6 +87,16 @@ int librailcan_dcc_locomotive_set_speed( struct librailcan_module* module , uint
   if( speed > speed_steps )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_locomotive_set_speed , module , address , value , 0 , 0 , 0 );
+
+  struct dcc_packet* packet;
+  int r;
+
+  if( ( r = module_dcc_packet_list_get( module , address , dcc_speed_and_direction , &packet ) ) != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+  else if( !packet && ( r = module_dcc_packet_create( module , address , dcc_speed_and_direction , &packet ) ) != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
   module_dcc_packet_set_speed( module , packet , speed_steps , speed );
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -104,6 +109,8 @@ int librailcan_dcc_locomotive_set_direction( struct librailcan_module* module ,
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_locomotive_set_direction , module , address , value , 0 , 0 , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -124,6 +131,8 @@ int librailcan_dcc_locomotive_set_function( struct librailcan_module* module , u
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_dcc_locomotive_set_function , module , address , index , value , 0 , 0 );
+
   struct dcc_packet* packet = NULL;
   int r;
 
@@ -157,6 +166,8 @@ int librailcan_dcc_locomotive_write_cv( struct librailcan_module* module , uint1
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_locomotive_write_cv , module , address , cv , value , 0 , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -176,14 +187,14 @@ int librailcan_dcc_locomotive_write_cv( struct librailcan_module* module , uint1
 
     default: // Use long form.
       if( ( r = module_dcc_write_cv( module , packet , cv , value ) ) != LIBRAILCAN_STATUS_SUCCESS )
-        free( packet );
+        module_dcc_packet_free( module , packet );
 
       return r;
   }
 
   // Use short form:
-  packet->data[ packet->data_length++ ] = 0xf0 | code; // Configuration Variable Access Instruction - Short Form (1111CCCC) - CCCC = code
-  packet->data[ packet->data_length++ ] = value;
+  packet->frame.data[ packet->frame.dlc++ ] = 0xf0 | code; // Configuration Variable Access Instruction - Short Form (1111CCCC) - CCCC = code
+  packet->frame.data[ packet->frame.dlc++ ] = value;
 
   module_dcc_packet_queue_move_front( module , packet );
 
@@ -197,6 +208,8 @@ int librailcan_dcc_locomotive_write_cv_bit( struct librailcan_module* module , u
   else if( module->type != LIBRAILCAN_MODULETYPE_DCC )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_dcc_locomotive_write_cv_bit , module , address , cv , bit , value , 0 );
+
   struct dcc_packet* packet;
   int r;
 
@@ -205,7 +218,7 @@ int librailcan_dcc_locomotive_write_cv_bit( struct librailcan_module* module , u
 
   if( ( r = module_dcc_write_cv_bit( module , packet , cv , bit , value ) ) != LIBRAILCAN_STATUS_SUCCESS )
   {
-    free( packet );
+    module_dcc_packet_free( module , packet );
     return r;
   }
 
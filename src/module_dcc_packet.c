@@ -26,27 +26,301 @@
 #else
 #  define assert( x )
 #endif
+#include "allocator.h"
 #include "module.h"
+#include "bus.h"
 
-#define DATA_INDEX( packet ) ( ( (packet)->data[0] & 0x80 ) ? 2 : 1 ) //!< get long / short address data index
+#define DATA_INDEX( packet ) ( ( (packet)->frame.data[0] & 0x80 ) ? 2 : 1 ) //!< get long / short address data index
+
+static const uint64_t refresh_interval_default[ DCC_PACKET_TYPE_COUNT ] = //!< in nanoseconds
+{
+  [ dcc_speed_and_direction ] = 250000000 ,
+  [ dcc_f0_f4 ] = 500000000 ,
+  [ dcc_f5_f8 ] = 500000000 ,
+  [ dcc_f9_f12 ] = 500000000 ,
+  [ dcc_f13_f20 ] = 1000000000 ,
+  [ dcc_f21_f28 ] = 1000000000 ,
+  [ dcc_locomotive_disposable ] = 250000000 ,
+  [ dcc_basic_accessory ] = 250000000 ,
+  [ dcc_basic_accessory_disposable ] = 250000000 ,
+  [ dcc_extended_accessory ] = 250000000 ,
+  [ dcc_extended_accessory_disposable ] = 250000000 ,
+};
+
+static inline uint64_t refresh_interval( const struct module_dcc* dcc , enum dcc_packet_type type )
+{
+  return dcc->refresh_interval[ type ] ? dcc->refresh_interval[ type ] : refresh_interval_default[ type ];
+}
+
+static int refresh_heap_reserve( struct module_dcc* dcc , size_t length )
+{
+  if( dcc->refresh_heap.length >= length )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  void* p = allocator_realloc( dcc->refresh_heap.items , length * sizeof( *dcc->refresh_heap.items ) );
+  if( !p )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  dcc->refresh_heap.items = p;
+  dcc->refresh_heap.length = length;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static inline void refresh_heap_set( struct module_dcc* dcc , size_t i , struct dcc_packet* packet )
+{
+  dcc->refresh_heap.items[ i ] = packet;
+  packet->heap_index = i;
+}
+
+static inline bool refresh_heap_contains( const struct module_dcc* dcc , const struct dcc_packet* packet )
+{
+  return packet->heap_index < dcc->refresh_heap.count && dcc->refresh_heap.items[ packet->heap_index ] == packet;
+}
+
+static void refresh_heap_sift_up( struct module_dcc* dcc , size_t i )
+{
+  struct dcc_packet* packet = dcc->refresh_heap.items[ i ];
+
+  while( i > 0 )
+  {
+    const size_t parent = ( i - 1 ) / 2;
+    if( dcc->refresh_heap.items[ parent ]->deadline <= packet->deadline )
+      break;
+    refresh_heap_set( dcc , i , dcc->refresh_heap.items[ parent ] );
+    i = parent;
+  }
+
+  refresh_heap_set( dcc , i , packet );
+}
+
+static void refresh_heap_sift_down( struct module_dcc* dcc , size_t i )
+{
+  struct dcc_packet* packet = dcc->refresh_heap.items[ i ];
+
+  for( ;; )
+  {
+    size_t child = 2 * i + 1;
+    if( child >= dcc->refresh_heap.count )
+      break;
+    if( child + 1 < dcc->refresh_heap.count && dcc->refresh_heap.items[ child + 1 ]->deadline < dcc->refresh_heap.items[ child ]->deadline )
+      child++;
+    if( packet->deadline <= dcc->refresh_heap.items[ child ]->deadline )
+      break;
+    refresh_heap_set( dcc , i , dcc->refresh_heap.items[ child ] );
+    i = child;
+  }
+
+  refresh_heap_set( dcc , i , packet );
+}
+
+static void refresh_heap_update( struct module_dcc* dcc , struct dcc_packet* packet )
+{
+  if( !refresh_heap_contains( dcc , packet ) )
+  {
+    assert( dcc->refresh_heap.count < dcc->refresh_heap.length );
+    refresh_heap_set( dcc , dcc->refresh_heap.count++ , packet );
+  }
+
+  refresh_heap_sift_up( dcc , packet->heap_index );
+  refresh_heap_sift_down( dcc , packet->heap_index );
+}
+
+static void refresh_heap_remove( struct module_dcc* dcc , struct dcc_packet* packet )
+{
+  if( !refresh_heap_contains( dcc , packet ) )
+    return;
+
+  const size_t i = packet->heap_index;
+  struct dcc_packet* last = dcc->refresh_heap.items[ --dcc->refresh_heap.count ];
+
+  if( last != packet )
+  {
+    refresh_heap_set( dcc , i , last );
+    refresh_heap_sift_up( dcc , i );
+    refresh_heap_sift_down( dcc , last->heap_index );
+  }
+}
+
+int module_dcc_refresh_heap_build( struct librailcan_module* module )
+{
+  struct module_dcc* dcc = module->private_data;
+  int r;
+
+  if( ( r = refresh_heap_reserve( dcc , dcc->stats.packet_pool_capacity ) ) != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  dcc->refresh_heap.count = 0;
+
+  if( dcc->packet_queue )
+  {
+    struct dcc_packet* packet = dcc->packet_queue;
+    do
+    {
+      packet->deadline = packet->last_sent ? packet->last_sent + refresh_interval( dcc , packet->type ) : 0;
+      refresh_heap_set( dcc , dcc->refresh_heap.count++ , packet );
+      packet = packet->next;
+    }
+    while( packet != dcc->packet_queue );
+  }
+
+  for( size_t i = dcc->refresh_heap.count / 2 ; i-- > 0 ; )
+    refresh_heap_sift_down( dcc , i );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static inline size_t list_hash( uint16_t address , enum dcc_packet_type type , size_t mask )
+{
+  // Fibonacci hashing of ( address , type ):
+  return ( ( ( (uint32_t)address << 4 ) | (uint32_t)type ) * UINT32_C( 2654435769 ) >> 8 ) & mask;
+}
+
+static void list_index_insert( struct module_dcc* dcc , struct dcc_packet* packet )
+{
+  const size_t mask = dcc->packet_list.index_length - 1;
+  size_t i = list_hash( packet->address , packet->type , mask );
+
+  while( dcc->packet_list.index[ i ] )
+    i = ( i + 1 ) & mask;
+
+  dcc->packet_list.index[ i ] = packet;
+}
+
+static int packet_list_reserve( struct module_dcc* dcc , size_t count )
+{
+  if( dcc->packet_list.length >= count )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  size_t length = ( dcc->packet_list.length == 0 ) ? 32 : dcc->packet_list.length;
+  while( length < count )
+    length *= 2;
+
+  void* p = allocator_realloc( dcc->packet_list.items , length * sizeof( *dcc->packet_list.items ) );
+  if( !p )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  dcc->packet_list.items = p;
+
+  // Rebuild index at a load factor of at most one half:
+  struct dcc_packet** index = allocator_calloc( length * 2 , sizeof( *index ) );
+  if( !index )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  allocator_free( dcc->packet_list.index );
+  dcc->packet_list.index = index;
+  dcc->packet_list.index_length = length * 2;
+  dcc->packet_list.length = length;
+
+  for( size_t i = 0 ; i < dcc->packet_list.count ; i++ )
+    list_index_insert( dcc , dcc->packet_list.items[ i ] );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int module_dcc_packet_pool_reserve( struct librailcan_module* module , size_t count )
+{
+  struct module_dcc* dcc = module->private_data;
+
+  if( dcc->stats.packet_pool_capacity >= count )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  // Size the list and the heap too, so adding packets doesn't allocate:
+  if( packet_list_reserve( dcc , count ) != LIBRAILCAN_STATUS_SUCCESS ||
+      refresh_heap_reserve( dcc , count ) != LIBRAILCAN_STATUS_SUCCESS )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  const size_t length = count - dcc->stats.packet_pool_capacity;
+  struct dcc_packet_slab* slab = allocator_malloc( sizeof( *slab ) + length * sizeof( slab->packets[0] ) );
+
+  if( !slab )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  slab->length = length;
+  slab->next = dcc->packet_pool.slabs;
+  dcc->packet_pool.slabs = slab;
+
+  // Add to free list, lowest address first:
+  for( size_t i = length ; i-- > 0 ; )
+  {
+    slab->packets[ i ].next = dcc->packet_pool.free_list;
+    dcc->packet_pool.free_list = &slab->packets[ i ];
+  }
+
+  dcc->stats.packet_pool_capacity += length;
+  dcc->stats.packet_pool_slabs++;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+void module_dcc_packet_pool_release( struct librailcan_module* module )
+{
+  struct module_dcc* dcc = module->private_data;
+
+  while( dcc->packet_pool.slabs )
+  {
+    struct dcc_packet_slab* slab = dcc->packet_pool.slabs;
+    dcc->packet_pool.slabs = slab->next;
+    allocator_free( slab );
+  }
+
+  dcc->packet_pool.free_list = NULL;
+  dcc->stats.packet_pool_capacity = 0;
+  dcc->stats.packet_pool_used = 0;
+  dcc->stats.packet_pool_slabs = 0;
+}
+
+struct dcc_packet* module_dcc_packet_alloc( struct librailcan_module* module )
+{
+  struct module_dcc* dcc = module->private_data;
+
+  if( !dcc->packet_pool.free_list )
+  {
+    // Grow by another slab sized for the expected number of locomotives:
+    const size_t expected = dcc->packet_pool.expected_locomotives ? dcc->packet_pool.expected_locomotives : DCC_EXPECTED_LOCOMOTIVES_DEFAULT;
+
+    if( module_dcc_packet_pool_reserve( module , dcc->stats.packet_pool_capacity + expected * DCC_PACKETS_PER_LOCOMOTIVE ) != LIBRAILCAN_STATUS_SUCCESS )
+      return NULL;
+  }
+
+  struct dcc_packet* packet = dcc->packet_pool.free_list;
+  dcc->packet_pool.free_list = packet->next;
+
+  if( ++dcc->stats.packet_pool_used > dcc->stats.packet_pool_high_water )
+    dcc->stats.packet_pool_high_water = dcc->stats.packet_pool_used;
+
+  return packet;
+}
+
+void module_dcc_packet_free( struct librailcan_module* module , struct dcc_packet* packet )
+{
+  struct module_dcc* dcc = module->private_data;
+
+  packet->next = dcc->packet_pool.free_list;
+  dcc->packet_pool.free_list = packet;
+  dcc->stats.packet_pool_used--;
+}
 
 int module_dcc_packet_create( struct librailcan_module* module , uint16_t address , enum dcc_packet_type type , struct dcc_packet** packet )
 {
   // Create a new packet:
-  *packet = calloc( 1 , sizeof( **packet ) );
+  *packet = module_dcc_packet_alloc( module );
 
   if( !(*packet) )
     return LIBRAILCAN_STATUS_NO_MEMORY;
 
+  memset( *packet , 0 , sizeof( **packet ) );
+
   (*packet)->address = address;
   (*packet)->type = type;
+  (*packet)->frame.id = RAILCAN_SID( RAILCAN_SID_MESSAGE_DCC , module->address );
 
   // Setup address:
   int n = 0;
   switch( type )
   {
     case dcc_idle:
-      (*packet)->data[ n++ ] = 0xff;
+      (*packet)->frame.data[ n++ ] = 0xff;
       break;
 
     case dcc_speed_and_direction:
@@ -58,28 +332,28 @@ int module_dcc_packet_create( struct librailcan_module* module , uint16_t addres
     case dcc_locomotive_disposable:
       if( address & LIBRAILCAN_DCC_LOCOMOTIVE_ADDRESS_LONG )
       {
-        (*packet)->data[ n++ ] = 0x80 | ( ( address >> 8 ) & 0x3f ); // 10aaaaaa
-        (*packet)->data[ n++ ] = address & 0xff; // aaaaaaaa
+        (*packet)->frame.data[ n++ ] = 0x80 | ( ( address >> 8 ) & 0x3f ); // 10aaaaaa
+        (*packet)->frame.data[ n++ ] = address & 0xff; // aaaaaaaa
       }
       else // short address
-        (*packet)->data[ n++ ] = address & 0x7f; // 0aaaaaaa
+        (*packet)->frame.data[ n++ ] = address & 0x7f; // 0aaaaaaa
       break;
 
     case dcc_basic_accessory:
       // NOTE: address = 0000 aaaa aaaa addd
-      (*packet)->data[ n++ ] = 0x80 | ( address >> 6 ); // 10aaaaaa
-      (*packet)->data[ n   ] = 0x80 | ( ( address << 1 ) & 0x70 ); // 1aaacddd
+      (*packet)->frame.data[ n++ ] = 0x80 | ( address >> 6 ); // 10aaaaaa
+      (*packet)->frame.data[ n   ] = 0x80 | ( ( address << 1 ) & 0x70 ); // 1aaacddd
       break;
 
     case dcc_basic_accessory_disposable:
-      (*packet)->data[ n++ ] = 0x80 | ( address >> 3 ); // 10aaaaaa
-      (*packet)->data[ n++ ] = 0x80 | ( ( address << 4 ) & 0x70 ); // 1aaacddd
+      (*packet)->frame.data[ n++ ] = 0x80 | ( address >> 3 ); // 10aaaaaa
+      (*packet)->frame.data[ n++ ] = 0x80 | ( ( address << 4 ) & 0x70 ); // 1aaacddd
       break;
 
     case dcc_extended_accessory:
     case dcc_extended_accessory_disposable:
-      (*packet)->data[ n++ ] = 0x80 | ( address >> 5 ); // 10aaaaaa
-      (*packet)->data[ n++ ] = ( ( address << 2 ) & 0x70 ) | ( ( address << 1 ) & 0x06 ) | 0x01; // 0aaa0aa1
+      (*packet)->frame.data[ n++ ] = 0x80 | ( address >> 5 ); // 10aaaaaa
+      (*packet)->frame.data[ n++ ] = ( ( address << 2 ) & 0x70 ) | ( ( address << 1 ) & 0x06 ) | 0x01; // 0aaa0aa1
       break;
 
     default:
@@ -90,48 +364,48 @@ int module_dcc_packet_create( struct librailcan_module* module , uint16_t addres
   switch( type )
   {
     case dcc_idle:
-      (*packet)->data[ n++ ] = 0x00;
+      (*packet)->frame.data[ n++ ] = 0x00;
       break;
 
     case dcc_speed_and_direction:
       (*packet)->speed_steps = dcc_28;
-      (*packet)->data[ n++ ] = 0x61; // Speed and direction instruction (01DSSSSS), D=fwd, S=ESTOP
+      (*packet)->frame.data[ n++ ] = 0x61; // Speed and direction instruction (01DSSSSS), D=fwd, S=ESTOP
       break;
 
     case dcc_f0_f4:
-      (*packet)->data[ n++ ] = 0x80; // Function group one instruction (100xxxxx)
+      (*packet)->frame.data[ n++ ] = 0x80; // Function group one instruction (100xxxxx)
       break;
 
     case dcc_f5_f8:
-      (*packet)->data[ n++ ] = 0xb0; // Function group two instruction (101Sxxxx), (S = 1)
+      (*packet)->frame.data[ n++ ] = 0xb0; // Function group two instruction (101Sxxxx), (S = 1)
       break;
 
     case dcc_f9_f12:
-      (*packet)->data[ n++ ] = 0xa0; // Function group two instruction (101Sxxxx), (S = 0)
+      (*packet)->frame.data[ n++ ] = 0xa0; // Function group two instruction (101Sxxxx), (S = 0)
       break;
 
     case dcc_f13_f20:
-      (*packet)->data[ n++ ] = 0xde; // Feature expansion instruction (110CCCCC), F13-F20 function control (CCCCC = 11110)
-      (*packet)->data[ n++ ] = 0x00;
+      (*packet)->frame.data[ n++ ] = 0xde; // Feature expansion instruction (110CCCCC), F13-F20 function control (CCCCC = 11110)
+      (*packet)->frame.data[ n++ ] = 0x00;
       break;
 
     case dcc_f21_f28:
-      (*packet)->data[ n++ ] = 0xdf; // Feature expansion instruction (110CCCCC), F21-F28 function control (CCCCC = 11111)
-      (*packet)->data[ n++ ] = 0x00;
+      (*packet)->frame.data[ n++ ] = 0xdf; // Feature expansion instruction (110CCCCC), F21-F28 function control (CCCCC = 11111)
+      (*packet)->frame.data[ n++ ] = 0x00;
       break;
 
     case dcc_locomotive_disposable:
       break;
 
     case dcc_basic_accessory:
-      (*packet)->data[ n++ ] |= address & 0x7; // (1aaacddd), c=output enable, ddd=output number
+      (*packet)->frame.data[ n++ ] |= address & 0x7; // (1aaacddd), c=output enable, ddd=output number
       break;
 
     case dcc_basic_accessory_disposable:
       break;
 
     case dcc_extended_accessory:
-      (*packet)->data[ n++ ] = 0x00; // (000xxxxx), xxxxx=absolute stop aspect
+      (*packet)->frame.data[ n++ ] = 0x00; // (000xxxxx), xxxxx=absolute stop aspect
       break;
 
     case dcc_extended_accessory_disposable:
@@ -141,7 +415,7 @@ int module_dcc_packet_create( struct librailcan_module* module , uint16_t addres
       assert( "invalid dcc_packet_type" );
   }
 
-  (*packet)->data_length = n;
+  (*packet)->frame.dlc = n;
 
   switch( type )
   {
@@ -160,7 +434,7 @@ int module_dcc_packet_create( struct librailcan_module* module , uint16_t addres
       int r = module_dcc_packet_list_add( module , *packet );
       if( r != LIBRAILCAN_STATUS_SUCCESS )
       {
-        free( *packet );
+        module_dcc_packet_free( module , *packet );
         return r;
       }
       break;
@@ -173,7 +447,7 @@ int module_dcc_packet_create( struct librailcan_module* module , uint16_t addres
 int module_dcc_packet_clone( struct librailcan_module* module , struct dcc_packet* packet_src , struct dcc_packet** packet )
 {
   // Create a new packet:
-  *packet = malloc( sizeof( **packet ) );
+  *packet = module_dcc_packet_alloc( module );
 
   if( !(*packet) )
     return LIBRAILCAN_STATUS_NO_MEMORY;
@@ -190,31 +464,49 @@ void module_dcc_packet_delete( struct librailcan_module* module , struct dcc_pac
 {
   module_dcc_packet_queue_remove( module , packet );
   module_dcc_packet_list_remove( module , packet );
-  free( packet );
+  module_dcc_packet_free( module , packet );
 }
 
-int module_dcc_packet_list_add( struct librailcan_module* module , struct dcc_packet* packet )
+static void list_index_remove( struct module_dcc* dcc , struct dcc_packet* packet )
 {
-  struct module_dcc* dcc = module->private_data;
+  const size_t mask = dcc->packet_list.index_length - 1;
+  size_t i = list_hash( packet->address , packet->type , mask );
 
-  if( dcc->packet_list.length == dcc->packet_list.count )
+  while( dcc->packet_list.index[ i ] != packet )
   {
-    if( dcc->packet_list.length == 0 )
-      dcc->packet_list.length = 32;
-    else
-      dcc->packet_list.length *= 2;
-
-    void* p = realloc( dcc->packet_list.items , dcc->packet_list.length * sizeof( *dcc->packet_list.items ) );
+    assert( dcc->packet_list.index[ i ] );
+    i = ( i + 1 ) & mask;
+  }
 
-    if( !p )
-      return LIBRAILCAN_STATUS_NO_MEMORY;
+  // Backward shift deletion, keeps probe sequences intact without tombstones:
+  for( size_t j = ( i + 1 ) & mask ; dcc->packet_list.index[ j ] ; j = ( j + 1 ) & mask )
+  {
+    const size_t home = list_hash( dcc->packet_list.index[ j ]->address , dcc->packet_list.index[ j ]->type , mask );
 
-    dcc->packet_list.items = p;
+    // Move the entry into the hole if its home slot is not cyclically in ( i , j ]:
+    if( ( ( j - home ) & mask ) >= ( ( j - i ) & mask ) )
+    {
+      dcc->packet_list.index[ i ] = dcc->packet_list.index[ j ];
+      i = j;
+    }
   }
 
+  dcc->packet_list.index[ i ] = NULL;
+}
+
+int module_dcc_packet_list_add( struct librailcan_module* module , struct dcc_packet* packet )
+{
+  struct module_dcc* dcc = module->private_data;
+
+  if( dcc->packet_list.length == dcc->packet_list.count && packet_list_reserve( dcc , dcc->packet_list.count + 1 ) != LIBRAILCAN_STATUS_SUCCESS )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  packet->list_index = dcc->packet_list.count;
   dcc->packet_list.items[ dcc->packet_list.count ] = packet;
   dcc->packet_list.count++;
 
+  list_index_insert( dcc , packet );
+
   dcc->stats.list_packet_count = dcc->packet_list.count;
 
   return LIBRAILCAN_STATUS_SUCCESS;
@@ -223,15 +515,20 @@ int module_dcc_packet_list_add( struct librailcan_module* module , struct dcc_pa
 void module_dcc_packet_list_remove( struct librailcan_module* module , struct dcc_packet* packet )
 {
   struct module_dcc* dcc = module->private_data;
+  const size_t i = packet->list_index;
 
-  for( size_t i = 0 ; i < dcc->packet_list.count ; i++ )
-    if( dcc->packet_list.items[ i ] == packet )
-    {
-      dcc->packet_list.count--;
-      if( i < dcc->packet_list.count )
-        memmove( dcc->packet_list.items + i , dcc->packet_list.items + i + 1 , ( dcc->packet_list.count - i ) * sizeof( *(dcc->packet_list.items) ) );
-      break;
-    }
+  if( i >= dcc->packet_list.count || dcc->packet_list.items[ i ] != packet )
+    return; // not in the list
+
+  list_index_remove( dcc , packet );
+
+  // Swap with last:
+  dcc->packet_list.count--;
+  if( i < dcc->packet_list.count )
+  {
+    dcc->packet_list.items[ i ] = dcc->packet_list.items[ dcc->packet_list.count ];
+    dcc->packet_list.items[ i ]->list_index = i;
+  }
 
   dcc->stats.list_packet_count = dcc->packet_list.count;
 }
@@ -242,11 +539,16 @@ int module_dcc_packet_list_get( struct librailcan_module* module , uint16_t addr
 
   *packet = NULL;
 
-  for( size_t i = 0 ; i < dcc->packet_list.count ; i++ )
-    if( dcc->packet_list.items[ i ]->address == address &&
-        dcc->packet_list.items[ i ]->type == type )
+  if( dcc->packet_list.count == 0 )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  const size_t mask = dcc->packet_list.index_length - 1;
+
+  for( size_t i = list_hash( address , type , mask ) ; dcc->packet_list.index[ i ] ; i = ( i + 1 ) & mask )
+    if( dcc->packet_list.index[ i ]->address == address &&
+        dcc->packet_list.index[ i ]->type == type )
     {
-      *packet = dcc->packet_list.items[ i ];
+      *packet = dcc->packet_list.index[ i ];
       break;
     }
 
@@ -302,6 +604,13 @@ void module_dcc_packet_queue_move_front( struct librailcan_module* module , stru
     dcc->packet_queue->previous = packet;
     dcc->packet_queue = packet;
   }
+
+  if( dcc->scheduler == LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+  {
+    // Changed, send as soon as the overdue packets are sent:
+    packet->deadline = bus_now( module->bus );
+    refresh_heap_update( dcc , packet );
+  }
 }
 
 void module_dcc_packet_queue_remove( struct librailcan_module* module , struct dcc_packet* packet )
@@ -318,15 +627,45 @@ void module_dcc_packet_queue_remove( struct librailcan_module* module , struct d
     }
     else // Extract packet from queue:
     {
+      if( dcc->packet_queue == packet )
+        dcc->packet_queue = packet->next;
+
       packet->next->previous = packet->previous;
       packet->previous->next = packet->next;
 
       dcc->stats.queue_packet_count--;
     }
 
+    refresh_heap_remove( dcc , packet );
+
     // Clear:
     packet->next = NULL;
     packet->previous = NULL;
+    packet->last_sent = 0;
+  }
+}
+
+void module_dcc_packet_queue_sent( struct librailcan_module* module , struct dcc_packet* packet , uint64_t time )
+{
+  struct module_dcc* dcc = module->private_data;
+  const uint64_t interval = refresh_interval( dcc , packet->type );
+
+  if( packet->last_sent )
+  {
+    const uint64_t elapsed = time - packet->last_sent;
+
+    if( elapsed > dcc->stats.refresh_interval_max )
+      dcc->stats.refresh_interval_max = elapsed;
+    if( elapsed > interval )
+      dcc->stats.refresh_deadline_misses++;
+  }
+
+  packet->last_sent = time;
+
+  if( dcc->scheduler == LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE )
+  {
+    packet->deadline = time + interval;
+    refresh_heap_sift_down( dcc , packet->heap_index );
   }
 }
 
@@ -339,9 +678,9 @@ void module_dcc_packet_set_speed( struct librailcan_module* module , struct dcc_
     enum dcc_direction direction;
 
     if( packet->speed_steps == dcc_128 )
-      direction = ( packet->data[n + 1] & 0x80 ) ? dcc_forward : dcc_reverse;
+      direction = ( packet->frame.data[n + 1] & 0x80 ) ? dcc_forward : dcc_reverse;
     else
-      direction = ( packet->data[n] & 0x20 ) ? dcc_forward : dcc_reverse;
+      direction = ( packet->frame.data[n] & 0x20 ) ? dcc_forward : dcc_reverse;
 
     packet->speed_steps = speed_steps;
 
@@ -349,53 +688,53 @@ void module_dcc_packet_set_speed( struct librailcan_module* module , struct dcc_
     {
       case dcc_14:
       case dcc_28:
-        packet->data[n] = 0x40; // Speed and direction instruction (01DFSSSS)
-        packet->data_length = n + 1;
+        packet->frame.data[n] = 0x40; // Speed and direction instruction (01DFSSSS)
+        packet->frame.dlc = n + 1;
         break;
 
       case dcc_128:
-        packet->data[n] = 0x9f; // Advanced operations instruction (100CCCCC), 128 Speed Step Control (CCCCC = 11111)
-        packet->data[n + 1] = 0x00;
-        packet->data_length = n + 2;
+        packet->frame.data[n] = 0x9f; // Advanced operations instruction (100CCCCC), 128 Speed Step Control (CCCCC = 11111)
+        packet->frame.data[n + 1] = 0x00;
+        packet->frame.dlc = n + 2;
         break;
     }
 
     if( direction == dcc_forward )
     {
       if( packet->speed_steps == dcc_128 )
-        packet->data[n + 1] |= 0x80;
+        packet->frame.data[n + 1] |= 0x80;
       else
-        packet->data[n] |= 0x20;
+        packet->frame.data[n] |= 0x20;
     }
   }
 
   switch( packet->speed_steps ) // Clear speed bits.
   {
     case dcc_14:
-      packet->data[n] &= 0xf0;
+      packet->frame.data[n] &= 0xf0;
       break;
     case dcc_28:
-      packet->data[n] &= 0xe0;
+      packet->frame.data[n] &= 0xe0;
       break;
     case dcc_128:
       n++;
-      packet->data[n] &= 0x80;
+      packet->frame.data[n] &= 0x80;
       break;
   }
 
   if( speed == -1 ) // emergency stop
-    packet->data[n] |= 0x01;
+    packet->frame.data[n] |= 0x01;
   else if( speed > 0 )
   {
     if( packet->speed_steps == dcc_28 )
     {
       speed += 3; // 0x04 => step 1
-      packet->data[n] |= speed >> 1;
+      packet->frame.data[n] |= speed >> 1;
       if( speed & 0x01 )
-        packet->data[n] |= 0x10;
+        packet->frame.data[n] |= 0x10;
     }
     else
-      packet->data[n] |= speed + 1; // 0x02 => step 1
+      packet->frame.data[n] |= speed + 1; // 0x02 => step 1
   }
 
   module_dcc_packet_update_ttl_and_flags( packet );
@@ -421,9 +760,9 @@ void module_dcc_packet_set_direction( struct librailcan_module* module , struct
   }
 
   if( direction == dcc_forward )
-    packet->data[n] |= mask;
+    packet->frame.data[n] |= mask;
   else // dcc_reverse
-    packet->data[n] &= ~mask;
+    packet->frame.data[n] &= ~mask;
 
   module_dcc_packet_update_ttl_and_flags( packet );
 
@@ -488,9 +827,9 @@ void module_dcc_packet_set_function( struct librailcan_module* module , struct d
   }
 
   if( enabled )
-    packet->data[n] |= mask;
+    packet->frame.data[n] |= mask;
   else
-    packet->data[n] &= ~mask;
+    packet->frame.data[n] &= ~mask;
 
   module_dcc_packet_update_ttl_and_flags( packet );
 
@@ -506,23 +845,23 @@ void module_dcc_packet_update_ttl_and_flags( struct dcc_packet* packet )
   {
     case dcc_speed_and_direction:
       if( packet->speed_steps == dcc_128 )
-        packet->remove = ( ( packet->data[ n + 1 ] & 0x7f ) == 0x01 );
+        packet->remove = ( ( packet->frame.data[ n + 1 ] & 0x7f ) == 0x01 );
       else
-        packet->remove = ( ( packet->data[ n ] & 0x1f ) == 0x01 );
+        packet->remove = ( ( packet->frame.data[ n ] & 0x1f ) == 0x01 );
       break;
 
     case dcc_f0_f4:
-      packet->remove = ( ( packet->data[ n ] & 0x1f ) == 0x00 );
+      packet->remove = ( ( packet->frame.data[ n ] & 0x1f ) == 0x00 );
       break;
 
     case dcc_f5_f8:
     case dcc_f9_f12:
-      packet->remove = ( ( packet->data[ n ] & 0x0f ) == 0x00 );
+      packet->remove = ( ( packet->frame.data[ n ] & 0x0f ) == 0x00 );
       break;
 
     case dcc_f13_f20:
     case dcc_f21_f28:
-      packet->remove = ( packet->data[ n + 1 ] == 0x00 );
+      packet->remove = ( packet->frame.data[ n + 1 ] == 0x00 );
       break;
 
     case dcc_basic_accessory:
@@ -553,7 +892,7 @@ static int module_dcc_program_cv( struct librailcan_module* module , struct dcc_
 
   if( ( r = module_dcc_packet_clone( module , packet , &packet_clone ) ) != LIBRAILCAN_STATUS_SUCCESS )
   {
-    free( packet_idle ); // not in list and/or queue
+    module_dcc_packet_free( module , packet_idle ); // not in list and/or queue
     return r;
   }
 
@@ -576,9 +915,9 @@ int module_dcc_write_cv( struct librailcan_module* module , struct dcc_packet* p
 
   cv--; // cv - 1 must be sent
 
-  packet->data[ packet->data_length++ ] = 0xec | ( cv >> 8 ); // Configuration Variable Access Instruction - Long Form (1110CCAA) - CC = Write byte
-  packet->data[ packet->data_length++ ] = cv & 0xff;
-  packet->data[ packet->data_length++ ] = value;
+  packet->frame.data[ packet->frame.dlc++ ] = 0xec | ( cv >> 8 ); // Configuration Variable Access Instruction - Long Form (1110CCAA) - CC = Write byte
+  packet->frame.data[ packet->frame.dlc++ ] = cv & 0xff;
+  packet->frame.data[ packet->frame.dlc++ ] = value;
 
   return module_dcc_program_cv( module , packet );
 }
@@ -590,9 +929,9 @@ int module_dcc_write_cv_bit( struct librailcan_module* module , struct dcc_packe
 
   cv--; // cv - 1 must be sent
 
-  packet->data[ packet->data_length++ ] = 0xe8 | ( cv >> 8 ); // Configuration Variable Access Instruction - Long Form (1110CCAA) - CC = Bit manipulation
-  packet->data[ packet->data_length++ ] = cv & 0xff;
-  packet->data[ packet->data_length++ ] = 0xf0 | ( value ? 0x08 : 0x00 ) | bit; // 111CDBBB
+  packet->frame.data[ packet->frame.dlc++ ] = 0xe8 | ( cv >> 8 ); // Configuration Variable Access Instruction - Long Form (1110CCAA) - CC = Bit manipulation
+  packet->frame.data[ packet->frame.dlc++ ] = cv & 0xff;
+  packet->frame.data[ packet->frame.dlc++ ] = 0xf0 | ( value ? 0x08 : 0x00 ) | bit; // 111CDBBB
 
   return module_dcc_program_cv( module , packet );
 }
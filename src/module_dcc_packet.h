@@ -24,6 +24,11 @@
 
 #include "module_dcc_types.h"
 
+int module_dcc_packet_pool_reserve( struct librailcan_module* module , size_t count );
+void module_dcc_packet_pool_release( struct librailcan_module* module );
+struct dcc_packet* module_dcc_packet_alloc( struct librailcan_module* module );
+void module_dcc_packet_free( struct librailcan_module* module , struct dcc_packet* packet );
+
 int module_dcc_packet_create( struct librailcan_module* module , uint16_t address , enum dcc_packet_type type , struct dcc_packet** packet );
 int module_dcc_packet_clone( struct librailcan_module* module , struct dcc_packet* packet_src , struct dcc_packet** packet );
 void module_dcc_packet_delete( struct librailcan_module* module , struct dcc_packet* packet );
@@ -36,6 +41,9 @@ void module_dcc_priority_queue_push_back( struct librailcan_module* module , str
 
 void module_dcc_packet_queue_move_front( struct librailcan_module* module , struct dcc_packet* packet );
 void module_dcc_packet_queue_remove( struct librailcan_module* module , struct dcc_packet* packet );
+void module_dcc_packet_queue_sent( struct librailcan_module* module , struct dcc_packet* packet , uint64_t time );
+
+int module_dcc_refresh_heap_build( struct librailcan_module* module );
 
 void module_dcc_packet_change_speed_steps( struct librailcan_module* module , struct dcc_packet* packet , enum dcc_speed_steps speed_steps );
 
@@ -25,6 +25,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include "librailcan.h"
+#include "bus.h"
   #include <string.h> // for: size_t
 
 enum dcc_packet_type
@@ -43,6 +44,8 @@ enum dcc_packet_type
   dcc_extended_accessory_disposable
 };
 
+#define DCC_PACKET_TYPE_COUNT ( dcc_extended_accessory_disposable + 1 )
+
 enum dcc_speed_steps
 {
   dcc_14 = 14 ,
@@ -62,19 +65,41 @@ enum dcc_direction
 #define DCC_PACKET_TTL_DISPOSABLE 1
 #define DCC_PACKET_TTL_ACCESSORY  2
 
+#define DCC_PACKETS_PER_LOCOMOTIVE        8 //!< Six persistent packet types plus room for disposable packets.
+#define DCC_EXPECTED_LOCOMOTIVES_DEFAULT  16
+
+#define DCC_PACKET_LENGTH_MAX      5 //!< Longest DCC packet in a reply frame, a longer reply is in the packed format.
+#define DCC_PACKETS_PER_FRAME_MAX  ( LIBRAILCAN_FD_DATA_MAX / 3 ) //!< A length prefixed DCC packet takes at least three bytes.
+
+/**
+ * Optional byte following the info of a DCC module's INFO message: bit mask of the reply formats it accepts, bit \c n
+ * for LIBRAILCAN_DCC_REPLY_FORMAT_* \c n. Without it only single packet replies are sent.
+ */
+#define DCC_INFO_REPLY_FORMATS_OFFSET  sizeof( railcan_message_info_t )
+
 struct dcc_packet
 {
   uint16_t address;
   enum dcc_packet_type type;
   enum dcc_speed_steps speed_steps;
-  uint8_t data[8];
-  uint8_t data_length;
+  struct bus_frame frame; //!< Ready to send reply frame, kept up to date when the packet changes.
   int8_t ttl; //!< Number of times to send before removing from the queue or \c DCC_PACKET_TTL_INFINITE.
   bool remove; //!< Remove packet from the list when \c ttl reaches zero.
+  size_t list_index; //!< Index in \c packet_list.items, valid while in the list.
+  size_t heap_index; //!< Index in \c refresh_heap.items, valid while in the heap.
+  uint64_t last_sent; //!< Time of the last refresh, or \c 0 if not sent since it was added to the queue.
+  uint64_t deadline; //!< Refresh deadline, used by the earliest deadline first scheduler.
   struct dcc_packet* previous;
   struct dcc_packet* next;
 };
 
+struct dcc_packet_slab
+{
+  struct dcc_packet_slab* next;
+  size_t length;
+  struct dcc_packet packets[];
+};
+
 struct module_dcc
 {
   bool enabled;
@@ -83,11 +108,31 @@ struct module_dcc
     struct dcc_packet** items;
     size_t length;
     size_t count;
+    struct dcc_packet** index; //!< Open addressing hash table on ( address , type ), linear probing.
+    size_t index_length; //!< Always a power of two.
   } packet_list;
+  struct
+  {
+    struct dcc_packet_slab* slabs;
+    struct dcc_packet* free_list; //!< Linked by \c next.
+    size_t expected_locomotives; //!< Used to size new slabs.
+  } packet_pool;
   struct dcc_packet* packet_priority_queue;
   struct dcc_packet* packet_queue;
+  uint8_t reply_formats; //!< Bit mask of LIBRAILCAN_DCC_REPLY_FORMAT_* advertised by the module.
+  uint8_t reply_format;
+  uint8_t scheduler; //!< \ref LIBRAILCAN_DCC_SCHEDULER_ROUND_ROBIN or \ref LIBRAILCAN_DCC_SCHEDULER_EARLIEST_DEADLINE
+  uint64_t refresh_interval[ DCC_PACKET_TYPE_COUNT ]; //!< Refresh interval in nanoseconds, \c 0 for default.
+  struct
+  {
+    struct dcc_packet** items; //!< Binary min heap on \c deadline of all packets in \c packet_queue.
+    size_t length; //!< Kept at least the pool capacity, so insertion can't fail.
+    size_t count;
+  } refresh_heap;
   librailcan_dcc_get_packet_callback get_packet_callback;
   struct librailcan_dcc_stats stats;
+  struct bus_frame reset_frame;
+  struct bus_frame idle_frame;
 };
 
 #endif
@@ -21,23 +21,225 @@
 
 #include "module_io.h"
 #include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "allocator.h"
 #include "bus.h"
+#include "io_thread.h"
 #include "utils.h"
 #include "log.h"
 
+#define MODULE_IO_WORDS  ( LIBRAILCAN_FD_DATA_MAX / sizeof( uint64_t ) ) //!< Bitmap words for the largest frame, 512 IO's.
+
+/**
+ * \brief Packed IO state, bit \c i of the bitmaps belongs to IO \c i.
+ */
+struct module_io_bank
+{
+  uint64_t valid[ MODULE_IO_WORDS ]; //!< IO state is known.
+  uint64_t value[ MODULE_IO_WORDS ];
+};
+
+/**
+ * \brief Software debounce state of a digital input.
+ */
+struct module_io_debounce
+{
+  uint64_t time; //!< Debounce time in nanoseconds, \c 0 is disabled.
+  uint64_t since; //!< Receive time of the frame that first showed the unreported value.
+};
+
+/**
+ * \brief Input event ring, single producer (the I/O path) and single consumer (librailcan_io_read_events()).
+ */
+struct module_io_events
+{
+  struct librailcan_io_event* ring; //!< \c NULL if disabled.
+  size_t capacity; //!< Always a power of two.
+  size_t head; //!< Written by the producer.
+  size_t tail; //!< Written by the consumer.
+  uint32_t sequence; //!< Sequence number of the next event.
+  uint64_t debounced[ MODULE_IO_WORDS ]; //!< Inputs with debounce enabled.
+  uint64_t reported_valid[ MODULE_IO_WORDS ]; //!< Debounced inputs with a reported value.
+  uint64_t reported[ MODULE_IO_WORDS ]; //!< Last reported value of debounced inputs.
+  uint64_t pending[ MODULE_IO_WORDS ]; //!< Debounced inputs waiting for their value to be stable.
+  struct module_io_debounce debounce[]; //!< One per digital input.
+};
+
 struct module_io
 {
   unsigned int digital_input_count;
-  librailcan_tristate* digital_inputs;
+  struct module_io_bank digital_inputs;
   librailcan_digital_io_changed_callback digital_input_changed_callback;
+  librailcan_digital_io_bulk_changed_callback digital_input_bulk_changed_callback;
   unsigned int digital_output_count;
-  librailcan_tristate* digital_outputs;
+  struct module_io_bank digital_outputs;
   librailcan_digital_io_changed_callback digital_output_changed_callback;
+  librailcan_digital_io_bulk_changed_callback digital_output_bulk_changed_callback;
+  struct module_io_events* events; //!< Allocated when the event ring or debounce is first configured.
 };
 
+static inline librailcan_tristate bank_get( const struct module_io_bank* bank , unsigned int index )
+{
+  const uint64_t bit = UINT64_C( 1 ) << ( index % 64 );
+
+  if( !( bank->valid[ index / 64 ] & bit ) )
+    return LIBRAILCAN_TRISTATE_UNDEFINED;
+
+  return ( bank->value[ index / 64 ] & bit ) ? LIBRAILCAN_TRISTATE_TRUE : LIBRAILCAN_TRISTATE_FALSE;
+}
+
+/**
+ * \brief Merge received IO state into a bank and report the IO's that changed.
+ *
+ * Compares a word of 64 IO's at a time, a frame without changes costs one XOR per word.
+ */
+static void bank_update( struct librailcan_module* module , struct module_io_bank* bank , unsigned int count , int8_t dlc , const uint8_t* data , librailcan_digital_io_changed_callback callback , librailcan_digital_io_bulk_changed_callback bulk_callback , uint64_t* changed )
+{
+  const unsigned int length = min( count , (unsigned int)dlc * 8 ); // up to 512 with CAN FD
+  bool any = false;
+
+  memset( changed , 0 , MODULE_IO_WORDS * sizeof( *changed ) );
+
+  for( unsigned int w = 0 ; w * 64 < length ; w++ )
+  {
+    const unsigned int bits = length - w * 64;
+    const uint64_t mask = ( bits >= 64 ) ? UINT64_MAX : ( UINT64_C( 1 ) << bits ) - 1;
+    uint64_t value = 0;
+
+    memcpy( &value , data + w * 8 , min( (unsigned int)dlc - w * 8 , 8U ) );
+    value = le64toh( value ) & mask;
+
+    changed[ w ] = ( ( bank->value[ w ] ^ value ) | ~bank->valid[ w ] ) & mask;
+
+    if( !changed[ w ] )
+      continue;
+
+    bank->value[ w ] = ( bank->value[ w ] & ~mask ) | value;
+    bank->valid[ w ] |= mask;
+    any = true;
+
+    if( !callback )
+      continue;
+
+    for( uint64_t c = changed[ w ] ; c ; c &= c - 1 )
+    {
+      const unsigned int bit = __builtin_ctzll( c );
+
+      callback( module , w * 64 + bit , ( value >> bit ) & 1 ? LIBRAILCAN_TRISTATE_TRUE : LIBRAILCAN_TRISTATE_FALSE );
+    }
+  }
+
+  if( any && bulk_callback )
+    bulk_callback( module , changed , bank->value , count );
+}
+
+static void events_push( struct module_io_events* events , unsigned int index , bool value , uint64_t timestamp )
+{
+  const size_t head = events->head;
+  const uint32_t sequence = events->sequence++;
+
+  if( head - __atomic_load_n( &events->tail , __ATOMIC_ACQUIRE ) == events->capacity )
+    return; // ring full, the reader sees a gap in the sequence numbers
+
+  struct librailcan_io_event* event = &events->ring[ head & ( events->capacity - 1 ) ];
+
+  event->timestamp = timestamp;
+  event->sequence = sequence;
+  event->index = index;
+  event->value = value ? LIBRAILCAN_TRISTATE_TRUE : LIBRAILCAN_TRISTATE_FALSE;
+
+  __atomic_store_n( &events->head , head + 1 , __ATOMIC_RELEASE );
+}
+
+/**
+ * \brief Queue input changes, debounced inputs are only queued once their new value is stable for the debounce time.
+ *
+ * Stability is checked when frames are received, nodes resend their input state so pending inputs are picked up.
+ */
+static void events_update( struct module_io* io , const uint64_t* changed , uint64_t now )
+{
+  struct module_io_events* events = io->events;
+
+  for( unsigned int w = 0 ; w * 64 < io->digital_input_count ; w++ )
+  {
+    for( uint64_t work = changed[ w ] | events->pending[ w ] ; work ; work &= work - 1 )
+    {
+      const unsigned int bit = __builtin_ctzll( work );
+      const uint64_t mask = UINT64_C( 1 ) << bit;
+      const unsigned int index = w * 64 + bit;
+      const bool value = io->digital_inputs.value[ w ] & mask;
+      struct module_io_debounce* debounce = &events->debounce[ index ];
+
+      if( !( events->debounced[ w ] & mask ) )
+        events_push( events , index , value , now );
+      else if( !( events->reported_valid[ w ] & mask ) ) // initial state isn't debounced
+      {
+        events->reported_valid[ w ] |= mask;
+        events->reported[ w ] = ( events->reported[ w ] & ~mask ) | ( value ? mask : 0 );
+        events_push( events , index , value , now );
+      }
+      else if( value == !!( events->reported[ w ] & mask ) ) // chatter, back at the reported value
+        events->pending[ w ] &= ~mask;
+      else if( !( events->pending[ w ] & mask ) )
+      {
+        events->pending[ w ] |= mask;
+        debounce->since = now;
+      }
+      else if( now - debounce->since >= debounce->time )
+      {
+        events->pending[ w ] &= ~mask;
+        events->reported[ w ] ^= mask;
+        events_push( events , index , value , debounce->since );
+      }
+    }
+  }
+}
+
+static struct module_io_events* events_get( struct module_io* io )
+{
+  if( !io->events )
+    io->events = allocator_calloc( 1 , sizeof( *io->events ) + io->digital_input_count * sizeof( io->events->debounce[ 0 ] ) );
+
+  return io->events;
+}
+
+/**
+ * \brief Send one OUTPUTS frame with the masked outputs changed, the output state is only updated if the frame is accepted.
+ */
+static int outputs_write( struct librailcan_module* module , const uint64_t* mask , const uint64_t* values )
+{
+  struct module_io* io = module->private_data;
+  const unsigned int length = ( io->digital_output_count + 7 ) / 8;
+  const unsigned int words = ( io->digital_output_count + 63 ) / 64;
+  uint64_t frame[ MODULE_IO_WORDS ] = { 0 };
+
+  if( length > module->bus->frame_data_max )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED; // output bank needs CAN FD
+
+  // Undefined outputs are sent as off:
+  for( unsigned int w = 0 ; w < words ; w++ )
+    frame[ w ] = htole64( ( io->digital_outputs.value[ w ] & ~mask[ w ] ) | ( values[ w ] & mask[ w ] ) );
+
+  int r = module->bus->send( module->bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_OUTPUTS , module->address ) , length , frame );
+
+  if( r == LIBRAILCAN_STATUS_SUCCESS )
+  {
+    for( unsigned int w = 0 ; w < words ; w++ )
+    {
+      io->digital_outputs.value[ w ] = le64toh( frame[ w ] );
+      io->digital_outputs.valid[ w ] |= mask[ w ];
+    }
+  }
+  else
+    LOG_ERROR( "can_send failed: %d" , r );
+
+  return r;
+}
+
 int module_io_init( struct librailcan_module* module , const railcan_message_info_t* info )
 {
-  struct module_io* io = calloc( 1 , sizeof( *io ) );
+  struct module_io* io = allocator_calloc( 1 , sizeof( *io ) );
   if( !io )
     goto error;
 
@@ -53,14 +255,22 @@ int module_io_init( struct librailcan_module* module , const railcan_message_inf
   return LIBRAILCAN_STATUS_SUCCESS;
 
 error:
-  free( io );
+  allocator_free( io );
 
   return LIBRAILCAN_STATUS_NO_MEMORY;
 }
 
 void module_io_free( struct librailcan_module* module )
 {
-  free( module->private_data );
+  struct module_io* io = module->private_data;
+
+  if( io->events )
+  {
+    allocator_free( io->events->ring );
+    allocator_free( io->events );
+  }
+
+  allocator_free( io );
 
   module_free( module );
 }
@@ -71,16 +281,6 @@ int module_io_open( struct librailcan_module* module )
   if( r != LIBRAILCAN_STATUS_SUCCESS )
     return r;
 
-  struct module_io* io = module->private_data;
-
-  io->digital_inputs = calloc( io->digital_input_count , sizeof( librailcan_tristate ) );
-  if( !io->digital_inputs )
-    goto error;
-
-  io->digital_outputs = calloc( io->digital_output_count , sizeof( librailcan_tristate ) );
-  if( !io->digital_outputs )
-    goto error;
-
   if( module->bus->send( module->bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_INPUTS , module->address ) , LIBRAILCAN_DLC_RTR , NULL ) != LIBRAILCAN_STATUS_SUCCESS )
     LOG_WARNING( "failed sending input rtr" );
 
@@ -88,74 +288,52 @@ int module_io_open( struct librailcan_module* module )
     LOG_WARNING( "failed sending output rtr" );
 
   return LIBRAILCAN_STATUS_SUCCESS;
-
-error:
-  free( io->digital_inputs );
-  free( io->digital_outputs );
-
-  io->digital_inputs = NULL;
-  io->digital_outputs = NULL;
-
-  return LIBRAILCAN_STATUS_NO_MEMORY;
 }
 
 void module_io_close( struct librailcan_module* module )
 {
   struct module_io* io = module->private_data;
 
-  free( io->digital_inputs );
-  free( io->digital_outputs );
+  // Forget the IO state:
+  memset( &io->digital_inputs , 0 , sizeof( io->digital_inputs ) );
+  memset( &io->digital_outputs , 0 , sizeof( io->digital_outputs ) );
 
-  io->digital_inputs = NULL;
-  io->digital_outputs = NULL;
+  if( io->events )
+  {
+    memset( io->events->reported_valid , 0 , sizeof( io->events->reported_valid ) );
+    memset( io->events->pending , 0 , sizeof( io->events->pending ) );
+  }
 
   module_close( module );
 }
 
-void module_io_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data )
+void module_io_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp )
 {
   struct module_io* io = module->private_data;
+  uint64_t changed[ MODULE_IO_WORDS ];
+
+  if( !module->is_open ) // state is only tracked while open
+    return;
 
   switch( RAILCAN_SID_TO_MESSAGE( id ) )
   {
     case RAILCAN_SID_MESSAGE_INPUTS:
-    {
       if( dlc == LIBRAILCAN_DLC_RTR )
         break;
 
-      const uint_fast8_t len = min( io->digital_input_count , dlc * 8 );
-      for( uint_fast8_t i = 0 ; i < len ; i++ )
-      {
-        librailcan_tristate value = ( ((uint8_t*)data)[ i / 8 ] & ( 1 << ( i % 8 ) ) ) ? LIBRAILCAN_TRISTATE_TRUE : LIBRAILCAN_TRISTATE_FALSE;
-        if( value != io->digital_inputs[ i ] )
-        {
-          io->digital_inputs[ i ] = value;
-          if( io->digital_input_changed_callback )
-            io->digital_input_changed_callback( module , i , value );
-        }
-      }
+      bank_update( module , &io->digital_inputs , io->digital_input_count , dlc , data , io->digital_input_changed_callback , io->digital_input_bulk_changed_callback , changed );
+
+      if( io->events && io->events->ring ) // also when nothing changed, pending debounced inputs may have become stable
+        events_update( io , changed , timestamp->software );
       break;
-    }
-    case RAILCAN_SID_MESSAGE_OUTPUTS:
-    {
-      if( dlc == LIBRAILCAN_DLC_RTR )
-        break;
 
-      const uint_fast8_t len = min( io->digital_output_count , dlc * 8 );
-      for( uint_fast8_t i = 0 ; i < len ; i++ )
-      {
-        librailcan_tristate value = ( ((uint8_t*)data)[ i / 8 ] & ( 1 << ( i % 8 ) ) ) ? LIBRAILCAN_TRISTATE_TRUE : LIBRAILCAN_TRISTATE_FALSE;
-        if( value != io->digital_outputs[ i ] )
-        {
-          io->digital_outputs[ i ] = value;
-          if( io->digital_output_changed_callback )
-            io->digital_output_changed_callback( module , i , value );
-        }
-      }
+    case RAILCAN_SID_MESSAGE_OUTPUTS:
+      if( dlc != LIBRAILCAN_DLC_RTR )
+        bank_update( module , &io->digital_outputs , io->digital_output_count , dlc , data , io->digital_output_changed_callback , io->digital_output_bulk_changed_callback , changed );
       break;
-    }
+
     default:
-      module_received( module , id , dlc , data );
+      module_received( module , id , dlc , data , timestamp );
       break;
   }
 }
@@ -179,12 +357,14 @@ int librailcan_io_read_digital_input( struct librailcan_module* module , unsigne
   else if( module->type != LIBRAILCAN_MODULETYPE_IO )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_io_read_digital_input , module , index , value , 0 , 0 , 0 );
+
   struct module_io* io = module->private_data;
 
   if( index >= io->digital_input_count )
     return LIBRAILCAN_STATUS_INVALID_INDEX;
 
-  *value = io->digital_inputs[ index ];
+  *value = bank_get( &io->digital_inputs , index );
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
@@ -194,11 +374,27 @@ int librailcan_io_set_digital_input_changed_callback( struct librailcan_module*
   if( !module )
     return LIBRAILCAN_STATUS_INVALID_PARAM;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_io_set_digital_input_changed_callback , module , callback , 0 , 0 , 0 , 0 );
+
   ((struct module_io*)module->private_data)->digital_input_changed_callback = callback;
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
 
+int librailcan_io_set_digital_input_bulk_changed_callback( struct librailcan_module* module , librailcan_digital_io_bulk_changed_callback callback )
+{
+  if( !module )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_IO )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_io_set_digital_input_bulk_changed_callback , module , callback , 0 , 0 , 0 , 0 );
+
+  ((struct module_io*)module->private_data)->digital_input_bulk_changed_callback = callback;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
 int librailcan_io_get_digital_output_count( struct librailcan_module* module , unsigned int* count )
 {
   if( !module || !count )
@@ -218,12 +414,14 @@ int librailcan_io_read_digital_output( struct librailcan_module* module , unsign
   else if( module->type != LIBRAILCAN_MODULETYPE_IO )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST( module->bus , io_cmd_io_read_digital_output , module , index , value , 0 , 0 , 0 );
+
   struct module_io* io = module->private_data;
 
   if( index >= io->digital_output_count )
     return LIBRAILCAN_STATUS_INVALID_INDEX;
 
-  *value = io->digital_outputs[ index ];
+  *value = bank_get( &io->digital_outputs , index );
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
@@ -237,33 +435,58 @@ int librailcan_io_write_digital_output( struct librailcan_module* module , unsig
   else if( !module->is_active )
     return LIBRAILCAN_STATUS_NOT_ACTIVE;
 
+  IO_THREAD_POST( module->bus , io_cmd_io_write_digital_output , module , index , value , 0 , 0 , 0 );
+
   struct module_io* io = module->private_data;
 
   if( index >= io->digital_output_count )
     return LIBRAILCAN_STATUS_INVALID_INDEX;
 
-  if( value != io->digital_outputs[ index ] )
+  if( value != bank_get( &io->digital_outputs , index ) )
   {
-    uint8_t data[8] = { 0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 };
-
-    for( uint_fast8_t i = 0 ; i < io->digital_output_count ; i++ )
-      if( ( i != index && io->digital_outputs[ i ] == LIBRAILCAN_TRISTATE_TRUE ) ||
-          ( i == index && value == LIBRAILCAN_TRISTATE_TRUE ) )
-        data[ i >> 3 ] |= 1 << ( i & 0x7 );
+    uint64_t mask[ MODULE_IO_WORDS ] = { 0 };
+    uint64_t values[ MODULE_IO_WORDS ] = { 0 };
 
-    int r = module->bus->send( module->bus , RAILCAN_SID( RAILCAN_SID_MESSAGE_OUTPUTS , module->address ) , ( io->digital_output_count + 7 ) / 8 , data );
+    mask[ index / 64 ] = UINT64_C( 1 ) << ( index % 64 );
+    if( value == LIBRAILCAN_TRISTATE_TRUE )
+      values[ index / 64 ] = mask[ index / 64 ];
 
-    if( r == LIBRAILCAN_STATUS_SUCCESS )
-      io->digital_outputs[ index ] = value;
-    else
-      LOG_ERROR( "can_send failed: %d" , r );
-
-    return r;
+    return outputs_write( module , mask , values );
   }
 
   return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 }
 
+int librailcan_io_write_digital_outputs( struct librailcan_module* module , const uint64_t* mask , const uint64_t* values )
+{
+  if( !module || !mask || !values )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_IO )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+  else if( !module->is_active )
+    return LIBRAILCAN_STATUS_NOT_ACTIVE;
+
+  struct module_io* io = module->private_data;
+  const unsigned int words = ( io->digital_output_count + 63 ) / 64;
+
+  if( words == 0 )
+    return LIBRAILCAN_STATUS_INVALID_INDEX;
+
+  IO_THREAD_POST( module->bus , io_cmd_io_write_digital_outputs , module , mask , values , 0 , 0 , 0 );
+
+  if( ( io->digital_output_count % 64 ) && ( mask[ words - 1 ] >> ( io->digital_output_count % 64 ) ) )
+    return LIBRAILCAN_STATUS_INVALID_INDEX;
+
+  uint64_t changed = 0;
+  for( unsigned int w = 0 ; w < words ; w++ )
+    changed |= ( ( io->digital_outputs.value[ w ] ^ values[ w ] ) | ~io->digital_outputs.valid[ w ] ) & mask[ w ];
+
+  if( !changed )
+    return LIBRAILCAN_STATUS_SUCCESS; // nothing to send
+
+  return outputs_write( module , mask , values );
+}
+
 int librailcan_io_set_digital_output_changed_callback( struct librailcan_module* module , librailcan_digital_io_changed_callback callback )
 {
   if( !module )
@@ -271,7 +494,124 @@ int librailcan_io_set_digital_output_changed_callback( struct librailcan_module*
   else if( module->type != LIBRAILCAN_MODULETYPE_IO )
     return LIBRAILCAN_STATUS_NOT_SUPPORTED;
 
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_io_set_digital_output_changed_callback , module , callback , 0 , 0 , 0 , 0 );
+
   ((struct module_io*)module->private_data)->digital_output_changed_callback = callback;
 
   return LIBRAILCAN_STATUS_SUCCESS;
 }
+
+int librailcan_io_set_digital_output_bulk_changed_callback( struct librailcan_module* module , librailcan_digital_io_bulk_changed_callback callback )
+{
+  if( !module )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_IO )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST_ASYNC( module->bus , io_cmd_io_set_digital_output_bulk_changed_callback , module , callback , 0 , 0 , 0 , 0 );
+
+  ((struct module_io*)module->private_data)->digital_output_bulk_changed_callback = callback;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_io_set_event_ring( struct librailcan_module* module , size_t capacity )
+{
+  if( !module )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_IO )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( module->bus , io_cmd_io_set_event_ring , module , capacity , 0 , 0 , 0 , 0 );
+
+  struct module_io* io = module->private_data;
+  struct librailcan_io_event* ring = NULL;
+  size_t length = 0;
+
+  if( capacity > 0 )
+  {
+    if( io->events && io->events->ring ) // a reader may be active, the ring must be disabled first
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+    // Round up to a power of two, so indexes can be masked:
+    length = 1;
+    while( length < capacity )
+      length <<= 1;
+
+    if( !events_get( io ) || !( ring = allocator_malloc( length * sizeof( *ring ) ) ) )
+      return LIBRAILCAN_STATUS_NO_MEMORY;
+  }
+  else if( !io->events )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  allocator_free( io->events->ring );
+
+  io->events->ring = ring;
+  io->events->capacity = length;
+  io->events->head = 0;
+  io->events->tail = 0;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_io_read_events( struct librailcan_module* module , struct librailcan_io_event* events , size_t count , size_t* read )
+{
+  if( !module || ( !events && count > 0 ) || !read )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_IO )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct module_io_events* e = ((struct module_io*)module->private_data)->events;
+
+  if( !e || !e->ring )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  const size_t tail = e->tail;
+  const size_t n = min( __atomic_load_n( &e->head , __ATOMIC_ACQUIRE ) - tail , count );
+
+  for( size_t i = 0 ; i < n ; i++ )
+    events[ i ] = e->ring[ ( tail + i ) & ( e->capacity - 1 ) ];
+
+  __atomic_store_n( &e->tail , tail + n , __ATOMIC_RELEASE );
+
+  *read = n;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_io_set_digital_input_debounce( struct librailcan_module* module , unsigned int index , uint32_t time )
+{
+  if( !module )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( module->type != LIBRAILCAN_MODULETYPE_IO )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  IO_THREAD_POST( module->bus , io_cmd_io_set_digital_input_debounce , module , index , time , 0 , 0 , 0 );
+
+  struct module_io* io = module->private_data;
+
+  if( index >= io->digital_input_count )
+    return LIBRAILCAN_STATUS_INVALID_INDEX;
+
+  struct module_io_events* events = events_get( io );
+  if( !events )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  const uint64_t mask = UINT64_C( 1 ) << ( index % 64 );
+  const unsigned int w = index / 64;
+
+  events->debounce[ index ].time = (uint64_t)time * 1000;
+  events->pending[ w ] &= ~mask;
+
+  if( time > 0 )
+  {
+    // Continue from the current state, so enabling debounce doesn't report it again:
+    events->debounced[ w ] |= mask;
+    events->reported_valid[ w ] = ( events->reported_valid[ w ] & ~mask ) | ( io->digital_inputs.valid[ w ] & mask );
+    events->reported[ w ] = ( events->reported[ w ] & ~mask ) | ( io->digital_inputs.value[ w ] & mask );
+  }
+  else
+    events->debounced[ w ] &= ~mask;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
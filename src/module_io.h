@@ -28,6 +28,6 @@ int module_io_init( struct librailcan_module* module , const railcan_message_inf
 void module_io_free( struct librailcan_module* module );
 int module_io_open( struct librailcan_module* module );
 void module_io_close( struct librailcan_module* module );
-void module_io_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data );
+void module_io_received( struct librailcan_module* module , uint32_t id , int8_t dlc , const void* data , const struct librailcan_timestamp* timestamp );
 
 #endif
@@ -0,0 +1,441 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#include "reactor.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef HAVE_SYS_EPOLL_H
+#  include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+#  include <sys/timerfd.h>
+#endif
+#include "allocator.h"
+#include "bus.h"
+#include "socketcan.h"
+#include "log.h"
+
+struct librailcan_reactor
+{
+  int epoll_fd;
+  struct reactor_source* sources;
+  struct reactor_source* removed; //!< Sources removed during librailcan_reactor_run(), freed when it returns.
+  bool running;
+  unsigned int bus_budget;
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static int source_add( struct librailcan_reactor* reactor , enum reactor_source_type type , int fd , uint32_t events , struct reactor_source** source )
+{
+  *source = allocator_calloc( 1 , sizeof( **source ) );
+  if( !*source )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  (*source)->type = type;
+  (*source)->reactor = reactor;
+  (*source)->fd = fd;
+  (*source)->events = events;
+
+  struct epoll_event event = {
+    .events = events ,
+    .data.ptr = *source
+  };
+
+  if( epoll_ctl( reactor->epoll_fd , EPOLL_CTL_ADD , fd , &event ) == -1 )
+  {
+    LOG_ERROR( "epoll_ctl: [%m]\n" );
+    allocator_free( *source );
+    *source = NULL;
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  (*source)->next = reactor->sources;
+  reactor->sources = *source;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static void source_remove( struct reactor_source* source )
+{
+  struct librailcan_reactor* reactor = source->reactor;
+
+  epoll_ctl( reactor->epoll_fd , EPOLL_CTL_DEL , source->fd , NULL );
+
+  for( struct reactor_source** p = &reactor->sources ; *p ; p = &(*p)->next )
+    if( *p == source )
+    {
+      *p = source->next;
+      break;
+    }
+
+  if( source->type == rs_timer )
+    close( source->fd );
+
+  source->fd = -1; // Mark removed, events for it may still be pending in librailcan_reactor_run().
+
+  if( reactor->running )
+  {
+    source->next = reactor->removed;
+    reactor->removed = source;
+  }
+  else
+    allocator_free( source );
+}
+
+static struct reactor_source* source_find( struct librailcan_reactor* reactor , enum reactor_source_type type , int fd )
+{
+  for( struct reactor_source* source = reactor->sources ; source ; source = source->next )
+    if( source->type == type && source->fd == fd )
+      return source;
+
+  return NULL;
+}
+
+static void bus_update_events( struct reactor_source* source )
+{
+  uint32_t events = EPOLLIN;
+
+  if( socketcan_send_pending( source->bus ) )
+    events |= EPOLLOUT;
+
+  if( events != source->events )
+  {
+    struct epoll_event event = {
+      .events = events ,
+      .data.ptr = source
+    };
+
+    if( epoll_ctl( source->reactor->epoll_fd , EPOLL_CTL_MOD , source->fd , &event ) == 0 )
+      source->events = events;
+    else
+      LOG_ERROR( "epoll_ctl: [%m]\n" );
+  }
+}
+
+static int bus_process( struct reactor_source* source , uint32_t events )
+{
+  struct librailcan_bus* bus = source->bus;
+  unsigned int budget = bus->socketcan.receive_budget;
+  int r = LIBRAILCAN_STATUS_SUCCESS;
+
+  if( budget == 0 || ( source->reactor->bus_budget != 0 && budget > source->reactor->bus_budget ) )
+    budget = source->reactor->bus_budget;
+
+  source->processing = true;
+
+  if( events & EPOLLOUT )
+    r = socketcan_flush( bus );
+
+  if( r == LIBRAILCAN_STATUS_SUCCESS && ( events & ( EPOLLIN | EPOLLERR ) ) )
+    r = socketcan_receive( bus , budget );
+
+  // Try to send replies right away, EPOLLOUT is only needed if the socket is full:
+  if( r == LIBRAILCAN_STATUS_SUCCESS && socketcan_send_pending( bus ) )
+    r = socketcan_flush( bus );
+
+  source->processing = false;
+
+  if( source->fd != -1 ) // bus may be removed from the reactor by a callback, the source is freed after the run
+    bus_update_events( source );
+
+  return r;
+}
+
+void reactor_bus_send_pending( struct librailcan_bus* bus )
+{
+  if( !bus->reactor_source->processing )
+    bus_update_events( bus->reactor_source );
+}
+
+void reactor_remove_bus( struct librailcan_bus* bus )
+{
+  source_remove( bus->reactor_source );
+  bus->reactor_source = NULL;
+}
+
+#endif
+
+int librailcan_reactor_create( struct librailcan_reactor** reactor )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  *reactor = allocator_calloc( 1 , sizeof( **reactor ) );
+  if( !*reactor )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  (*reactor)->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  if( (*reactor)->epoll_fd == -1 )
+  {
+    LOG_ERROR( "epoll_create1: [%m]\n" );
+    allocator_free( *reactor );
+    *reactor = NULL;
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  (*reactor)->bus_budget = REACTOR_BUS_BUDGET;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_destroy( struct librailcan_reactor* reactor )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor || reactor->running )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  while( reactor->sources )
+  {
+    struct reactor_source* source = reactor->sources;
+
+    if( source->type == rs_bus )
+      reactor_remove_bus( source->bus );
+    else
+      source_remove( source );
+  }
+
+  close( reactor->epoll_fd );
+  allocator_free( reactor );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_add_bus( struct librailcan_reactor* reactor , struct librailcan_bus* bus )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor || !bus || bus->reactor_source || bus->io_thread )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_socketcan )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct reactor_source* source;
+  int r = source_add( reactor , rs_bus , bus->socketcan.fd , EPOLLIN , &source );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  source->bus = bus;
+  bus->reactor_source = source;
+
+  bus_update_events( source );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_remove_bus( struct librailcan_reactor* reactor , struct librailcan_bus* bus )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor || !bus || !bus->reactor_source || bus->reactor_source->reactor != reactor )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  reactor_remove_bus( bus );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_set_bus_budget( struct librailcan_reactor* reactor , unsigned int frames )
+{
+  if( !reactor )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  reactor->bus_budget = frames;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_reactor_add_fd( struct librailcan_reactor* reactor , int fd , short events , librailcan_reactor_fd_callback callback , void* user_data )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor || fd < 0 || !callback )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  struct reactor_source* source;
+  int r = source_add( reactor , rs_fd , fd , (uint16_t)events , &source ); // poll and epoll event bits are equal
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  source->user.callback = callback;
+  source->user.user_data = user_data;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_remove_fd( struct librailcan_reactor* reactor , int fd )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  struct reactor_source* source = source_find( reactor , rs_fd , fd );
+  if( !source )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  source_remove( source );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_add_timer( struct librailcan_reactor* reactor , unsigned int interval , librailcan_reactor_timer_callback callback , void* user_data , int* timer )
+{
+#if defined( HAVE_SYS_EPOLL_H ) && defined( HAVE_SYS_TIMERFD_H )
+  if( !reactor || interval == 0 || !callback || !timer )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  int fd = timerfd_create( CLOCK_MONOTONIC , TFD_NONBLOCK | TFD_CLOEXEC );
+  if( fd == -1 )
+  {
+    LOG_ERROR( "timerfd_create: [%m]\n" );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = interval / 1000;
+  spec.it_interval.tv_nsec = ( interval % 1000 ) * 1000000L;
+  spec.it_value = spec.it_interval;
+
+  if( timerfd_settime( fd , 0 , &spec , NULL ) == -1 )
+  {
+    LOG_ERROR( "timerfd_settime: [%m]\n" );
+    close( fd );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  struct reactor_source* source;
+  int r = source_add( reactor , rs_timer , fd , EPOLLIN , &source );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+  {
+    close( fd );
+    return r;
+  }
+
+  source->timer.callback = callback;
+  source->timer.user_data = user_data;
+
+  *timer = fd;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_remove_timer( struct librailcan_reactor* reactor , int timer )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  struct reactor_source* source = source_find( reactor , rs_timer , timer );
+  if( !source )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  source_remove( source );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int librailcan_reactor_run( struct librailcan_reactor* reactor , int timeout )
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if( !reactor || reactor->running )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  struct epoll_event events[ REACTOR_MAX_EVENTS ];
+
+  int n = epoll_wait( reactor->epoll_fd , events , REACTOR_MAX_EVENTS , timeout );
+  if( n == -1 )
+    return ( errno == EINTR ) ? LIBRAILCAN_STATUS_SUCCESS : LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  else if( n == 0 )
+    return LIBRAILCAN_STATUS_TIMEOUT;
+
+  int result = LIBRAILCAN_STATUS_SUCCESS;
+
+  reactor->running = true;
+
+  // Buses with more frames than their budget stay ready, epoll then reports them after the other ready sources:
+  for( int i = 0 ; i < n ; i++ )
+  {
+    struct reactor_source* source = events[ i ].data.ptr;
+
+    if( source->fd == -1 ) // removed by an earlier callback
+      continue;
+
+    switch( source->type )
+    {
+      case rs_bus:
+      {
+        int r = bus_process( source , events[ i ].events );
+        if( r != LIBRAILCAN_STATUS_SUCCESS && result == LIBRAILCAN_STATUS_SUCCESS )
+          result = r;
+        break;
+      }
+      case rs_fd:
+        source->user.callback( reactor , source->fd , (short)events[ i ].events , source->user.user_data );
+        break;
+
+      case rs_timer:
+      {
+        uint64_t expirations;
+        if( read( source->fd , &expirations , sizeof( expirations ) ) == sizeof( expirations ) )
+          source->timer.callback( reactor , source->fd , source->timer.user_data );
+        break;
+      }
+    }
+  }
+
+  reactor->running = false;
+
+  while( reactor->removed )
+  {
+    struct reactor_source* source = reactor->removed;
+    reactor->removed = source->next;
+    allocator_free( source );
+  }
+
+  return result;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
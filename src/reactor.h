@@ -0,0 +1,74 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#include "librailcan.h"
+#include <stdbool.h>
+
+#define REACTOR_MAX_EVENTS  64 //!< Maximum number of events handled per librailcan_reactor_run() call.
+#define REACTOR_BUS_BUDGET  64 //!< Default maximum number of frames read from one bus per librailcan_reactor_run() call.
+
+enum reactor_source_type
+{
+  rs_bus ,
+  rs_fd ,
+  rs_timer
+};
+
+struct reactor_source
+{
+  enum reactor_source_type type;
+  struct librailcan_reactor* reactor;
+  int fd;
+  uint32_t events; //!< Currently registered epoll events.
+  bool processing; //!< Bus is being processed, its events are updated once when done.
+  union
+  {
+    struct librailcan_bus* bus;
+    struct
+    {
+      librailcan_reactor_fd_callback callback;
+      void* user_data;
+    } user;
+    struct
+    {
+      librailcan_reactor_timer_callback callback;
+      void* user_data;
+    } timer;
+  };
+  struct reactor_source* next;
+};
+
+/**
+ * \brief Enable \c EPOLLOUT for a bus whose send queue became non-empty.
+ *
+ * Does nothing while the bus is being processed by the reactor, the events are updated after its final flush.
+ */
+void reactor_bus_send_pending( struct librailcan_bus* bus );
+
+/**
+ * \brief Remove a bus from its reactor.
+ */
+void reactor_remove_bus( struct librailcan_bus* bus );
+
+#endif
@@ -0,0 +1,136 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#include "replay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "allocator.h"
+#include "bus.h"
+#include "trace.h"
+
+static int replay_send( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
+{
+  (void)id;
+  (void)data;
+
+  if( dlc > bus->frame_data_max )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  bus->stats.frames_sent++;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int replay_open( struct librailcan_bus* bus , const char* path )
+{
+  int r = trace_open( path , &bus->replay.file );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  bus->send = replay_send;
+  bus->frame_data_max = LIBRAILCAN_FD_DATA_MAX; // the trace may contain CAN FD frames
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+void replay_close( struct librailcan_bus* bus )
+{
+  fclose( bus->replay.file );
+}
+
+int librailcan_bus_open_replay( const char* path , struct librailcan_bus** bus )
+{
+  if( !path || !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  int r = bus_open( if_replay , bus );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  if( ( r = replay_open( *bus , path ) ) != LIBRAILCAN_STATUS_SUCCESS )
+  {
+    allocator_free( *bus );
+    *bus = NULL;
+  }
+
+  return r;
+}
+
+int librailcan_replay_run( struct librailcan_bus* bus , unsigned int speed )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_replay )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct trace_record record;
+  uint8_t data[ LIBRAILCAN_FD_DATA_MAX ];
+  struct timespec start;
+  uint64_t first = 0;
+  bool started = false;
+  int r;
+
+  clock_gettime( CLOCK_MONOTONIC , &start );
+
+  while( ( r = trace_read( bus->replay.file , &record , data ) ) == 1 )
+  {
+    if( record.id & TRACE_RECORD_TX ) // produced by the library itself
+      continue;
+
+    if( !started )
+    {
+      first = record.timestamp;
+      started = true;
+    }
+    else if( speed > 0 && record.timestamp > first )
+    {
+      const uint64_t offset = ( record.timestamp - first ) / speed;
+      struct timespec until = {
+        .tv_sec = start.tv_sec + ( start.tv_nsec + offset ) / 1000000000ULL ,
+        .tv_nsec = ( start.tv_nsec + offset ) % 1000000000ULL
+      };
+
+      int e;
+      while( ( e = clock_nanosleep( CLOCK_MONOTONIC , TIMER_ABSTIME , &until , NULL ) ) == EINTR )
+        ;
+
+      if( e != 0 )
+      {
+        r = LIBRAILCAN_STATUS_UNSUCCESSFUL;
+        break;
+      }
+    }
+
+    const struct librailcan_timestamp timestamp = {
+      .software = record.timestamp ,
+      .hardware = 0
+    };
+
+    bus->replay.now = record.timestamp;
+    bus->stats.frames_received++;
+
+    bus_received( bus , record.id , record.dlc , record.dlc > 0 ? data : NULL , &timestamp );
+  }
+
+  return r;
+}
@@ -21,38 +21,599 @@
 
 #include "socketcan.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#ifdef HAVE_LINUX_CAN_RAW_H
+#  include <linux/can/raw.h>
+#endif
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#  include <linux/net_tstamp.h>
+#endif
+#include "allocator.h"
 #include "librailcan.h"
 #include "../shared/railcan-proto/railcan_proto.h"
 #include "bus.h"
 #include "module.h"
+#include "reactor.h"
+#include "trace.h"
 #include "log.h"
 
+#ifdef HAVE_RECVMMSG
+static void get_timestamp( const struct msghdr* msg , struct librailcan_timestamp* timestamp )
+{
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+  for( struct cmsghdr* cmsg = CMSG_FIRSTHDR( msg ) ; cmsg ; cmsg = CMSG_NXTHDR( (struct msghdr*)msg , cmsg ) )
+    if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPING )
+    {
+      struct timespec ts[3]; // software, deprecated, raw hardware
+
+      memcpy( ts , CMSG_DATA( cmsg ) , sizeof( ts ) );
+
+      if( ts[0].tv_sec != 0 || ts[0].tv_nsec != 0 )
+        timestamp->software = (uint64_t)ts[0].tv_sec * 1000000000ULL + ts[0].tv_nsec;
+      if( ts[2].tv_sec != 0 || ts[2].tv_nsec != 0 )
+        timestamp->hardware = (uint64_t)ts[2].tv_sec * 1000000000ULL + ts[2].tv_nsec;
+    }
+#endif
+}
+#endif
+
+int socketcan_open( struct librailcan_bus* bus , int fd )
+{
+#ifdef HAVE_LINUX_CAN_H
+  bus->socketcan.fd = fd;
+  bus->socketcan.send_queue.overflow_policy = LIBRAILCAN_SEND_QUEUE_OVERFLOW_GROW;
+  bus->send = socketcan_send;
+  bus->send_frame = socketcan_send_frame;
+
+  socketcan_update_filter( bus );
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+  const int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  if( setsockopt( fd , SOL_SOCKET , SO_TIMESTAMPING , &flags , sizeof( flags ) ) == -1 )
+    LOG_WARNING( "setsockopt SO_TIMESTAMPING: [%m]\n" );
+#endif
+
+  return socketcan_resize_send_queue( bus , SOCKETCAN_SEND_QUEUE_CAPACITY_DEFAULT );
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+void socketcan_untag_module( struct librailcan_bus* bus , struct librailcan_module* module )
+{
+  for( size_t i = 0 ; i < bus->socketcan.send_queue.count ; i++ )
+  {
+    struct bus_send_tag* tag = &bus->socketcan.send_queue.tags[ ( bus->socketcan.send_queue.front + i ) & ( bus->socketcan.send_queue.capacity - 1 ) ];
+    if( tag->module == module )
+      memset( tag , 0 , sizeof( *tag ) );
+  }
+}
+
+void socketcan_close( struct librailcan_bus* bus )
+{
+  close( bus->socketcan.fd );
+  allocator_free( bus->socketcan.send_queue.frames );
+  allocator_free( bus->socketcan.send_queue.tags );
+}
+
+int socketcan_set_can_fd( struct librailcan_bus* bus , bool enabled )
+{
+#if defined( HAVE_LINUX_CAN_H ) && defined( HAVE_LINUX_CAN_RAW_H )
+  if( enabled )
+  {
+    // Check the interface MTU, a classic CAN interface silently drops FD frames:
+    struct sockaddr_can addr;
+    socklen_t addr_len = sizeof( addr );
+    struct ifreq ifr;
+
+    if( getsockname( bus->socketcan.fd , (struct sockaddr*)&addr , &addr_len ) == -1 ||
+        !if_indextoname( addr.can_ifindex , ifr.ifr_name ) ||
+        ioctl( bus->socketcan.fd , SIOCGIFMTU , &ifr ) == -1 )
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+    if( ifr.ifr_mtu != CANFD_MTU )
+      return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+  }
+  else
+  {
+    // Queued FD frames can't be written once the socket only accepts classic frames:
+    const size_t mask = bus->socketcan.send_queue.capacity - 1;
+
+    for( size_t i = 0 ; i < bus->socketcan.send_queue.count ; i++ )
+      if( bus->socketcan.send_queue.frames[ ( bus->socketcan.send_queue.front + i ) & mask ].len > CAN_MAX_DLEN )
+        return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  const int value = enabled ? 1 : 0;
+  if( setsockopt( bus->socketcan.fd , SOL_CAN_RAW , CAN_RAW_FD_FRAMES , &value , sizeof( value ) ) == -1 )
+  {
+    LOG_ERROR( "setsockopt CAN_RAW_FD_FRAMES: [%m]\n" );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int socketcan_update_filter( struct librailcan_bus* bus )
+{
+#if defined( HAVE_LINUX_CAN_H ) && defined( HAVE_LINUX_CAN_RAW_H )
+  struct can_filter filter[ 2 + sizeof( bus->modules_by_address ) / sizeof( *bus->modules_by_address ) ];
+  size_t n = 0;
+
+  if( !bus->socketcan.kernel_filter ) // std frames only
+  {
+    filter[ n ].can_id = 0;
+    filter[ n ].can_mask = CAN_EFF_FLAG;
+    n++;
+  }
+  else
+  {
+    // INFO messages from any address, so modules can be discovered by librailcan_bus_scan():
+    filter[ n ].can_id = RAILCAN_SID( RAILCAN_SID_MESSAGE_INFO , 0 );
+    filter[ n ].can_mask = CAN_EFF_FLAG | SOCKETCAN_SID_MESSAGE_MASK;
+    n++;
+
+    // All messages to the broadcast address:
+    filter[ n ].can_id = RAILCAN_SID( 0 , RAILCAN_SID_ADDRESS_BROADCAST );
+    filter[ n ].can_mask = CAN_EFF_FLAG | SOCKETCAN_SID_ADDRESS_MASK;
+    n++;
+
+    // All messages from known modules:
+    for( size_t i = 0 ; i < bus->module_count ; i++ )
+    {
+      filter[ n ].can_id = RAILCAN_SID( 0 , bus->modules[ i ]->address );
+      filter[ n ].can_mask = CAN_EFF_FLAG | SOCKETCAN_SID_ADDRESS_MASK;
+      n++;
+    }
+  }
+
+  if( setsockopt( bus->socketcan.fd , SOL_CAN_RAW , CAN_RAW_FILTER , filter , n * sizeof( *filter ) ) == -1 )
+  {
+    LOG_ERROR( "setsockopt CAN_RAW_FILTER: [%m]\n" );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int socketcan_resize_send_queue( struct librailcan_bus* bus , size_t capacity )
+{
+#ifdef HAVE_LINUX_CAN_H
+  // Round up to a power of two, so indexes can be masked:
+  size_t length = 1;
+  while( length < capacity )
+    length <<= 1;
+
+  if( length < bus->socketcan.send_queue.count )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( length == bus->socketcan.send_queue.capacity )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  struct canfd_frame* frames = allocator_malloc( length * sizeof( *frames ) );
+  struct bus_send_tag* tags = allocator_malloc( length * sizeof( *tags ) );
+  if( !frames || !tags )
+  {
+    allocator_free( frames );
+    allocator_free( tags );
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+  }
+
+  // Copy queued frames in order:
+  for( size_t i = 0 ; i < bus->socketcan.send_queue.count ; i++ )
+  {
+    const size_t j = ( bus->socketcan.send_queue.front + i ) & ( bus->socketcan.send_queue.capacity - 1 );
+    frames[ i ] = bus->socketcan.send_queue.frames[ j ];
+    tags[ i ] = bus->socketcan.send_queue.tags[ j ];
+
+    if( !( frames[ i ].can_id & CAN_RTR_FLAG ) && RAILCAN_SID_TO_MESSAGE( frames[ i ].can_id ) == RAILCAN_SID_MESSAGE_OUTPUTS )
+      bus->socketcan.send_queue.outputs_slot[ RAILCAN_SID_TO_ADDRESS( frames[ i ].can_id ) ] = i;
+  }
+
+  allocator_free( bus->socketcan.send_queue.frames );
+  allocator_free( bus->socketcan.send_queue.tags );
+
+  bus->socketcan.send_queue.frames = frames;
+  bus->socketcan.send_queue.tags = tags;
+  bus->socketcan.send_queue.capacity = length;
+  bus->socketcan.send_queue.front = 0;
+
+  bus->stats.send_queue_capacity = length;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+#ifdef HAVE_LINUX_CAN_H
+_Static_assert( sizeof( struct bus_frame ) == sizeof( struct can_frame ) &&
+                offsetof( struct bus_frame , dlc ) == offsetof( struct can_frame , can_dlc ) &&
+                offsetof( struct bus_frame , data ) == offsetof( struct can_frame , data ) , "struct bus_frame must match struct can_frame" );
+_Static_assert( offsetof( struct can_frame , can_dlc ) == offsetof( struct canfd_frame , len ) &&
+                offsetof( struct can_frame , data ) == offsetof( struct canfd_frame , data ) , "struct can_frame must be a prefix of struct canfd_frame" );
+
+/**
+ * \brief Round a payload length up to the next length a CAN FD frame can carry.
+ */
+static inline uint8_t fd_length( uint8_t length )
+{
+  static const uint8_t lengths[] = { 12 , 16 , 20 , 24 , 32 , 48 , 64 };
+
+  if( length <= CAN_MAX_DLEN )
+    return length;
+
+  for( size_t i = 0 ; i < sizeof( lengths ) ; i++ )
+    if( length <= lengths[ i ] )
+      return lengths[ i ];
+
+  return CANFD_MAX_DLEN;
+}
+
+static inline size_t frame_mtu( const struct canfd_frame* frame )
+{
+  return frame->len > CAN_MAX_DLEN ? CANFD_MTU : CAN_MTU;
+}
+
+static int send_queue_reserve( struct librailcan_bus* bus )
+{
+  if( bus->socketcan.send_queue.count == bus->socketcan.send_queue.capacity )
+  {
+    int r = LIBRAILCAN_STATUS_BUFFER_FULL;
+
+    if( bus->socketcan.send_queue.overflow_policy == LIBRAILCAN_SEND_QUEUE_OVERFLOW_GROW )
+      r = socketcan_resize_send_queue( bus , 2 * bus->socketcan.send_queue.capacity );
+
+    if( r != LIBRAILCAN_STATUS_SUCCESS )
+    {
+      bus->stats.send_queue_overflows++;
+      return r;
+    }
+
+    bus->stats.send_queue_grows++;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static inline struct canfd_frame* send_queue_tail( struct librailcan_bus* bus )
+{
+  const size_t index = ( bus->socketcan.send_queue.front + bus->socketcan.send_queue.count ) & ( bus->socketcan.send_queue.capacity - 1 );
+
+  bus->socketcan.send_queue.tags[ index ] = bus->send_tag;
+
+  return &bus->socketcan.send_queue.frames[ index ];
+}
+
+/**
+ * \brief Find the queued OUTPUTS frame of an address, it is superseded by a newer OUTPUTS frame.
+ */
+static struct canfd_frame* send_queue_find_outputs( struct librailcan_bus* bus , uint32_t id )
+{
+  const size_t mask = bus->socketcan.send_queue.capacity - 1;
+  const size_t slot = bus->socketcan.send_queue.outputs_slot[ RAILCAN_SID_TO_ADDRESS( id ) ];
+
+  if( slot > mask || ( ( slot - bus->socketcan.send_queue.front ) & mask ) >= bus->socketcan.send_queue.count )
+    return NULL; // not queued, or already written
+
+  struct canfd_frame* frame = &bus->socketcan.send_queue.frames[ slot ];
+
+  if( frame->can_id != ( id & CAN_SFF_MASK ) )
+    return NULL; // slot reused by another frame
+
+  bus->socketcan.send_queue.tags[ slot ] = bus->send_tag;
+
+  return frame;
+}
+
+static inline void send_queue_push( struct librailcan_bus* bus )
+{
+  bus->socketcan.send_queue.count++;
+
+#ifdef HAVE_SYS_EPOLL_H
+  if( bus->socketcan.send_queue.count == 1 && bus->reactor_source )
+    reactor_bus_send_pending( bus );
+#endif
+
+  if( bus->socketcan.send_queue.count > bus->stats.send_queue_high_water )
+    bus->stats.send_queue_high_water = bus->socketcan.send_queue.count;
+}
+#endif
+
 int socketcan_send( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
 {
 #ifdef HAVE_LINUX_CAN_H
   LOG_DEBUG( "send: message=%u, address=%u, dlc=%d\n" , RAILCAN_SID_TO_MESSAGE( id ) , RAILCAN_SID_TO_ADDRESS( id ) , dlc );
 
-  struct can_queue_item* item = calloc( 1 , sizeof( *item ) );
-  if( !item )
-    return LIBRAILCAN_STATUS_NO_MEMORY;
+  if( dlc > bus->frame_data_max )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
 
-  item->frame.can_id = id & CAN_SFF_MASK;
-  if( dlc == LIBRAILCAN_DLC_RTR )
-    item->frame.can_id |= CAN_RTR_FLAG;
+  const bool outputs = ( dlc != LIBRAILCAN_DLC_RTR && RAILCAN_SID_TO_MESSAGE( id ) == RAILCAN_SID_MESSAGE_OUTPUTS );
+  struct canfd_frame* frame = NULL;
+  bool queued = false;
+
+  // Output state is absolute, a newer frame replaces a queued one:
+  if( outputs && ( bus->socketcan.coalesce_outputs || bus->socketcan.cork > 0 ) && ( frame = send_queue_find_outputs( bus , id ) ) )
+    bus->stats.frames_coalesced++;
   else
   {
-    item->frame.can_dlc = dlc;
-    if( dlc > 0 )
-      memcpy( item->frame.data , data , dlc );
+    int r = send_queue_reserve( bus );
+    if( r != LIBRAILCAN_STATUS_SUCCESS )
+      return r;
+
+    if( outputs )
+      bus->socketcan.send_queue.outputs_slot[ RAILCAN_SID_TO_ADDRESS( id ) ] = ( bus->socketcan.send_queue.front + bus->socketcan.send_queue.count ) & ( bus->socketcan.send_queue.capacity - 1 );
+
+    frame = send_queue_tail( bus );
+    queued = true;
   }
 
-  if( !bus->socketcan.send_queue.front )
-    bus->socketcan.send_queue.front = item;
-  else
-    bus->socketcan.send_queue.rear->next = item;
+  memset( frame , 0 , offsetof( struct canfd_frame , data ) );
+  frame->can_id = id & CAN_SFF_MASK;
+  if( dlc == LIBRAILCAN_DLC_RTR )
+    frame->can_id |= CAN_RTR_FLAG;
+  else if( dlc > 0 )
+  {
+    frame->len = fd_length( dlc );
+    memcpy( frame->data , data , dlc );
+    if( frame->len > dlc ) // pad to a valid CAN FD length
+      memset( frame->data + dlc , 0 , frame->len - dlc );
+  }
+
+  if( queued )
+    send_queue_push( bus );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int socketcan_send_frame( struct librailcan_bus* bus , const struct bus_frame* frame )
+{
+#ifdef HAVE_LINUX_CAN_H
+  int r = send_queue_reserve( bus );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  memcpy( send_queue_tail( bus ) , frame , sizeof( *frame ) );
+
+  send_queue_push( bus );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+int socketcan_flush( struct librailcan_bus* bus )
+{
+#ifdef HAVE_LINUX_CAN_H
+  if( bus->socketcan.cork > 0 )
+    return LIBRAILCAN_STATUS_SUCCESS; // written on uncork
+
+  while( bus->socketcan.send_queue.count > 0 )
+  {
+    const size_t mask = bus->socketcan.send_queue.capacity - 1;
+
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[ SOCKETCAN_SEND_BATCH_SIZE ];
+    struct iovec iovs[ SOCKETCAN_SEND_BATCH_SIZE ];
+    unsigned int n = 0;
+
+    for( ; n < bus->socketcan.send_queue.count && n < SOCKETCAN_SEND_BATCH_SIZE ; n++ )
+    {
+      iovs[ n ].iov_base = &bus->socketcan.send_queue.frames[ ( bus->socketcan.send_queue.front + n ) & mask ];
+      iovs[ n ].iov_len = frame_mtu( iovs[ n ].iov_base );
+      memset( &msgs[ n ].msg_hdr , 0 , sizeof( msgs[ n ].msg_hdr ) );
+      msgs[ n ].msg_hdr.msg_iov = &iovs[ n ];
+      msgs[ n ].msg_hdr.msg_iovlen = 1;
+    }
+
+    int r = sendmmsg( bus->socketcan.fd , msgs , n , MSG_DONTWAIT );
+#else
+    const unsigned int n = 1;
 
-  bus->socketcan.send_queue.rear = item;
+    const struct canfd_frame* frame = &bus->socketcan.send_queue.frames[ bus->socketcan.send_queue.front ];
+    const size_t mtu = frame_mtu( frame );
+
+    const ssize_t written = write( bus->socketcan.fd , frame , mtu );
+
+    if( written >= 0 && written != (ssize_t)mtu ) // a CAN socket never writes part of a frame, errno isn't set
+    {
+      LOG_ERROR( "send: short write, %zd of %zu bytes\n" , written , mtu );
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+    }
+
+    int r = ( written == -1 ) ? -1 : 1;
+#endif
+
+    if( r == -1 )
+    {
+      if( errno == EINTR )
+        continue;
+      else if( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ) // socket or interface tx queue full, retry on next POLLOUT
+        break;
+
+      LOG_ERROR( "send: [%m]\n" );
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+    }
+
+    // Report write time of tagged frames and trace the written frames:
+    const uint64_t now = bus_clock();
+    for( int i = 0 ; i < r ; i++ )
+    {
+      const size_t index = ( bus->socketcan.send_queue.front + i ) & mask;
+      const struct bus_send_tag* tag = &bus->socketcan.send_queue.tags[ index ];
+      if( tag->written )
+        tag->written( tag , now );
+
+      if( bus->trace )
+      {
+        const struct canfd_frame* frame = &bus->socketcan.send_queue.frames[ index ];
+        trace_record( bus , true , now , frame->can_id & CAN_SFF_MASK , ( frame->can_id & CAN_RTR_FLAG ) ? LIBRAILCAN_DLC_RTR : frame->len , frame->data );
+      }
+    }
+
+    // Remove sent frames from the queue:
+    bus->socketcan.send_queue.front = ( bus->socketcan.send_queue.front + r ) & mask;
+    bus->socketcan.send_queue.count -= r;
+
+    bus->stats.frames_sent += r;
+
+    if( (unsigned int)r < n ) // partial batch, the error (if any) is reported by the next call
+      break;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+#else
+  return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+bool socketcan_send_pending( struct librailcan_bus* bus )
+{
+  return bus->socketcan.send_queue.count > 0 && bus->socketcan.cork == 0;
+}
+
+void socketcan_cork( struct librailcan_bus* bus )
+{
+  bus->socketcan.cork++;
+}
+
+int socketcan_uncork( struct librailcan_bus* bus )
+{
+  if( bus->socketcan.cork == 0 )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  else if( --bus->socketcan.cork > 0 )
+    return LIBRAILCAN_STATUS_SUCCESS;
+
+  int r = socketcan_flush( bus );
+
+#ifdef HAVE_SYS_EPOLL_H
+  if( bus->reactor_source ) // wait for EPOLLOUT if not all frames are written
+    reactor_bus_send_pending( bus );
+#endif
+
+  return r;
+}
+
+int socketcan_receive( struct librailcan_bus* bus , unsigned int budget )
+{
+#ifdef HAVE_LINUX_CAN_H
+  unsigned int count = 0;
+
+  while( budget == 0 || count < budget )
+  {
+    struct canfd_frame frames[ SOCKETCAN_RECEIVE_BATCH_SIZE ];
+    unsigned int n = SOCKETCAN_RECEIVE_BATCH_SIZE;
+
+    if( budget != 0 && budget - count < n )
+      n = budget - count;
+
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[ SOCKETCAN_RECEIVE_BATCH_SIZE ];
+    struct iovec iovs[ SOCKETCAN_RECEIVE_BATCH_SIZE ];
+    uint8_t controls[ SOCKETCAN_RECEIVE_BATCH_SIZE ][ SOCKETCAN_CONTROL_SIZE ] __attribute__(( aligned( sizeof( size_t ) ) ));
+
+    for( unsigned int i = 0 ; i < n ; i++ )
+    {
+      iovs[ i ].iov_base = &frames[ i ];
+      iovs[ i ].iov_len = sizeof( frames[ i ] );
+      memset( &msgs[ i ].msg_hdr , 0 , sizeof( msgs[ i ].msg_hdr ) );
+      msgs[ i ].msg_hdr.msg_iov = &iovs[ i ];
+      msgs[ i ].msg_hdr.msg_iovlen = 1;
+      msgs[ i ].msg_hdr.msg_control = controls[ i ];
+      msgs[ i ].msg_hdr.msg_controllen = sizeof( controls[ i ] );
+    }
+
+    int r = recvmmsg( bus->socketcan.fd , msgs , n , MSG_DONTWAIT , NULL );
+    bool closed = false;
+
+    for( int i = 0 ; i < r ; i++ )
+      if( msgs[ i ].msg_len == 0 ) // end of stream, only a socket pair stand-in gets here
+      {
+        closed = true;
+        r = i;
+        break;
+      }
+#else
+    n = 1;
+
+    ssize_t length = read( bus->socketcan.fd , &frames[ 0 ] , sizeof( frames[ 0 ] ) );
+    int r = ( length == -1 ) ? -1 : ( length == 0 ? 0 : 1 );
+    const bool closed = ( length == 0 );
+#endif
+
+    if( r == -1 )
+    {
+      if( errno == EINTR )
+        continue;
+      else if( errno == EAGAIN || errno == EWOULDBLOCK )
+        break;
+
+      LOG_ERROR( "receive: [%m]\n" );
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+    }
+
+    const uint64_t now = bus_clock();
+
+    for( int i = 0 ; i < r ; i++ )
+    {
+      const struct canfd_frame* frame = &frames[ i ];
+      struct librailcan_timestamp timestamp = {
+        .software = now ,
+        .hardware = 0
+      };
+
+#ifdef HAVE_RECVMMSG
+      if( msgs[ i ].msg_len != CAN_MTU && msgs[ i ].msg_len != CANFD_MTU )
+      {
+        bus->stats.frames_dropped++;
+        continue;
+      }
+
+      get_timestamp( &msgs[ i ].msg_hdr , &timestamp );
+#else
+      if( length != CAN_MTU && length != CANFD_MTU )
+      {
+        bus->stats.frames_dropped++;
+        continue;
+      }
+#endif
+#ifndef HAVE_LINUX_CAN_RAW_H
+      if( frame->can_id & CAN_EFF_FLAG ) // ignore extended frames
+      {
+        bus->stats.frames_dropped++;
+        continue;
+      }
+#endif
+      bus_received( bus , frame->can_id & CAN_SFF_MASK , ( frame->can_id & CAN_RTR_FLAG ) ? LIBRAILCAN_DLC_RTR : frame->len , frame->data , &timestamp );
+      bus->stats.frames_received++;
+    }
+
+    count += r;
+
+    if( closed )
+    {
+      LOG_ERROR( "receive: connection closed\n" );
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+    }
+    else if( (unsigned int)r < n ) // socket drained
+      break;
+  }
 
   return LIBRAILCAN_STATUS_SUCCESS;
 #else
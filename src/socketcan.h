@@ -22,25 +22,100 @@
 #ifndef _SOCKETCAN_H_
 #define _SOCKETCAN_H_
 
+#include <stdbool.h>
 #include "librailcan.h"
 
+struct bus_frame;
+
+#define SOCKETCAN_SEND_BATCH_SIZE  32 //!< Maximum number of frames passed to a single \c sendmmsg() call.
+#define SOCKETCAN_RECEIVE_BATCH_SIZE  32 //!< Maximum number of frames read by a single \c recvmmsg() call.
+
+#define SOCKETCAN_CONTROL_SIZE  64 //!< Ancillary data buffer size per received frame, fits \c CMSG_SPACE( 3 * sizeof( struct timespec ) ).
+#define SOCKETCAN_SEND_QUEUE_CAPACITY_DEFAULT  256 //!< Initial number of frame slots in the send queue.
+
 #ifdef HAVE_LINUX_CAN_H
 #  include <linux/can.h>
 
-struct can_queue_item
-{
-  struct can_frame frame;
-  struct can_queue_item* next;
-};
-
+#define SOCKETCAN_SID_ADDRESS_MASK  RAILCAN_SID( 0 , 0xff ) //!< Address bits of a RailCAN standard identifier.
+#define SOCKETCAN_SID_MESSAGE_MASK  ( CAN_SFF_MASK & ~SOCKETCAN_SID_ADDRESS_MASK ) //!< Message bits of a RailCAN standard identifier.
 #endif
 
 /**
- * \brief Add a RailCAN message to the send queue.
+ * \brief Initialize the socketcan part of a bus.
  *
+ * Takes ownership of \a fd and allocates the send queue.
+ */
+int socketcan_open( struct librailcan_bus* bus , int fd );
+
+/**
+ * \brief Clear the send tags of queued frames of a module that is being removed.
+ */
+void socketcan_untag_module( struct librailcan_bus* bus , struct librailcan_module* module );
+
+/**
+ * \brief Close the socket and free the send queue.
+ */
+void socketcan_close( struct librailcan_bus* bus );
+
+/**
+ * \brief (Re)install the kernel \c CAN_RAW_FILTER list.
  *
+ * Without kernel filtering only extended frames are rejected. With kernel filtering enabled only INFO messages,
+ * broadcast messages and messages of modules in the bus inventory are passed to userspace.
+ */
+int socketcan_update_filter( struct librailcan_bus* bus );
+
+/**
+ * \brief Enable or disable \c CAN_RAW_FD_FRAMES, enabling requires an interface with the CAN FD MTU.
+ */
+int socketcan_set_can_fd( struct librailcan_bus* bus , bool enabled );
+
+/**
+ * \brief Change the number of frame slots in the send queue.
  *
+ * \a capacity is rounded up to a power of two, queued frames are kept.
+ */
+int socketcan_resize_send_queue( struct librailcan_bus* bus , size_t capacity );
+
+/**
+ * \brief Add a RailCAN message to the send queue.
+ *
+ * The frame is stored in a preallocated slot, no memory is allocated unless the queue is full and the overflow policy is
+ * #LIBRAILCAN_SEND_QUEUE_OVERFLOW_GROW.
  */
 int socketcan_send( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data );
 
+int socketcan_send_frame( struct librailcan_bus* bus , const struct bus_frame* frame );
+
+/**
+ * \brief Write queued frames to the socket.
+ *
+ * Frames are written in batches of up to #SOCKETCAN_SEND_BATCH_SIZE using \c sendmmsg() when available.
+ * Frames that could not be written, e.g. because the interface tx queue is full (\c ENOBUFS), are kept in the queue.
+ */
+int socketcan_flush( struct librailcan_bus* bus );
+
+/**
+ * \brief Check if queued frames can be written, i.e. the queue is not empty and the bus is not corked.
+ */
+bool socketcan_send_pending( struct librailcan_bus* bus );
+
+/**
+ * \brief Hold queued frames until the matching socketcan_uncork() call, calls can be nested.
+ */
+void socketcan_cork( struct librailcan_bus* bus );
+
+/**
+ * \brief Release a socketcan_cork(), the queued frames are written when the last cork is released.
+ */
+int socketcan_uncork( struct librailcan_bus* bus );
+
+/**
+ * \brief Read received frames from the socket and dispatch them.
+ *
+ * Frames are read in batches of up to #SOCKETCAN_RECEIVE_BATCH_SIZE using \c recvmmsg() when available.
+ * Reading stops when the socket is drained or \a budget frames are read, \c 0 is unlimited.
+ */
+int socketcan_receive( struct librailcan_bus* bus , unsigned int budget );
+
 #endif
\ No newline at end of file
@@ -0,0 +1,230 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "log.h"
+
+#define TRACE_BUFFER_SIZE  65536 //!< stdio buffer size of a trace being recorded.
+
+static int trace_send( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
+{
+  int r = bus->trace->send( bus , id , dlc , data );
+
+  if( r == LIBRAILCAN_STATUS_SUCCESS )
+    trace_record( bus , true , bus_now( bus ) , id , dlc , data );
+
+  return r;
+}
+
+static int trace_send_frame( struct librailcan_bus* bus , const struct bus_frame* frame )
+{
+  const bool generic = ( bus->trace->send_frame == bus_send_frame_generic ); // traced by trace_send, which may stop the trace
+  int r = bus->trace->send_frame( bus , frame );
+
+  if( r == LIBRAILCAN_STATUS_SUCCESS && !generic )
+    trace_record( bus , true , bus_now( bus ) , frame->id , frame->dlc , frame->data );
+
+  return r;
+}
+
+int trace_start( struct librailcan_bus* bus , const char* path )
+{
+  struct trace* trace = allocator_calloc( 1 , sizeof( *trace ) );
+  if( !trace )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  trace->file = fopen( path , "ab" );
+  if( !trace->file )
+  {
+    allocator_free( trace );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  setvbuf( trace->file , NULL , _IOFBF , TRACE_BUFFER_SIZE );
+
+  if( ftell( trace->file ) == 0 ) // new file
+  {
+    struct trace_file_header header = {
+      .magic = TRACE_MAGIC ,
+      .version = TRACE_VERSION
+    };
+
+    if( fwrite( &header , sizeof( header ) , 1 , trace->file ) != 1 )
+    {
+      fclose( trace->file );
+      allocator_free( trace );
+      return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+    }
+  }
+
+  trace->send = bus->send;
+  trace->send_frame = bus->send_frame;
+  if( bus->interface != if_socketcan ) // a SocketCAN bus records frames when they are written, after coalescing
+  {
+    bus->send = trace_send;
+    bus->send_frame = trace_send_frame;
+  }
+  bus->trace = trace;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+void trace_stop( struct librailcan_bus* bus )
+{
+  struct trace* trace = bus->trace;
+
+  bus->send = trace->send;
+  bus->send_frame = trace->send_frame;
+  bus->trace = NULL;
+
+  fclose( trace->file );
+  allocator_free( trace );
+}
+
+void trace_record( struct librailcan_bus* bus , bool tx , uint64_t timestamp , uint32_t id , int8_t dlc , const void* data )
+{
+  struct trace* trace = bus->trace;
+  const struct trace_record record = {
+    .timestamp = timestamp ,
+    .id = ( id & TRACE_RECORD_ID_MASK ) | ( tx ? TRACE_RECORD_TX : 0 ) ,
+    .dlc = dlc
+  };
+
+  if( fwrite( &record , sizeof( record ) , 1 , trace->file ) != 1 ||
+      ( dlc > 0 && fwrite( data , dlc , 1 , trace->file ) != 1 ) )
+  {
+    LOG_ERROR( "trace: write failed after %zu records, tracing stopped [%m]\n" , trace->records );
+    trace_stop( bus );
+    return;
+  }
+
+  trace->records++;
+}
+
+int trace_open( const char* path , FILE** file )
+{
+  struct trace_file_header header;
+
+  *file = fopen( path , "rb" );
+  if( !*file )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  if( fread( &header , sizeof( header ) , 1 , *file ) != 1 ||
+      memcmp( header.magic , TRACE_MAGIC , sizeof( header.magic ) ) != 0 ||
+      header.version != TRACE_VERSION )
+  {
+    fclose( *file );
+    *file = NULL;
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int trace_read( FILE* file , struct trace_record* record , uint8_t* data )
+{
+  size_t n = fread( record , 1 , sizeof( *record ) , file );
+
+  if( n == 0 && feof( file ) )
+    return 0;
+  else if( n != sizeof( *record ) || record->dlc < LIBRAILCAN_DLC_RTR || record->dlc > LIBRAILCAN_FD_DATA_MAX )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  else if( record->dlc > 0 && fread( data , record->dlc , 1 , file ) != 1 )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  return 1;
+}
+
+int librailcan_bus_start_trace( struct librailcan_bus* bus , const char* path )
+{
+  if( !bus || !path )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->trace || bus->io_thread )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  return trace_start( bus , path );
+}
+
+int librailcan_bus_stop_trace( struct librailcan_bus* bus )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( !bus->trace || bus->io_thread )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  trace_stop( bus );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_trace_export_candump( const char* path , const char* output_path , const char* interface )
+{
+  if( !path || !output_path || !interface )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  FILE* file;
+  int r = trace_open( path , &file );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  FILE* output = fopen( output_path , "w" );
+  if( !output )
+  {
+    fclose( file );
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+  }
+
+  struct trace_record record;
+  uint8_t data[ LIBRAILCAN_FD_DATA_MAX ];
+
+  while( ( r = trace_read( file , &record , data ) ) == 1 )
+  {
+    // candump -l format: (seconds.microseconds) interface id#data
+    fprintf( output , "(%llu.%06llu) %s %03X#" ,
+      (unsigned long long)( record.timestamp / 1000000000ULL ) ,
+      (unsigned long long)( record.timestamp % 1000000000ULL / 1000 ) ,
+      interface ,
+      record.id & TRACE_RECORD_ID_MASK );
+
+    if( record.dlc == LIBRAILCAN_DLC_RTR )
+      fputc( 'R' , output );
+    else
+    {
+      if( record.dlc > LIBRAILCAN_DATA_MAX )
+        fputs( "#0" , output ); // CAN FD frame without flags
+
+      for( int8_t i = 0 ; i < record.dlc ; i++ )
+        fprintf( output , "%02X" , data[ i ] );
+    }
+
+    fputc( '\n' , output );
+  }
+
+  if( fclose( output ) != 0 && r == 0 )
+    r = LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  fclose( file );
+
+  return r == 0 ? LIBRAILCAN_STATUS_SUCCESS : r;
+}
@@ -0,0 +1,86 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "bus.h"
+
+#define TRACE_MAGIC  "RCTRACE" //!< First bytes of a trace file, including the terminating zero.
+#define TRACE_VERSION  1
+
+#define TRACE_RECORD_TX  0x8000 //!< Set in \ref trace_record::id for frames sent by the library.
+#define TRACE_RECORD_ID_MASK  0x07ff
+
+/**
+ * \brief Trace file header.
+ *
+ * A trace file is a header followed by records, all in host byte order. New records are only ever appended.
+ */
+struct trace_file_header
+{
+  char magic[ 8 ];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+/**
+ * \brief Trace record, followed by the frame data if \c dlc > 0.
+ */
+struct trace_record
+{
+  uint64_t timestamp; //!< Nanoseconds, RX frames: receive time, TX frames: write time on a SocketCAN bus, else the time the frame was passed to the bus.
+  uint16_t id; //!< 11 bit identifier or'ed with \ref TRACE_RECORD_TX.
+  int8_t dlc; //!< Data length or \ref LIBRAILCAN_DLC_RTR.
+} __attribute__(( packed ));
+
+struct trace
+{
+  FILE* file;
+  librailcan_bus_send send; //!< Send function of the bus while tracing.
+  bus_send_frame send_frame; //!< Send frame function of the bus while tracing.
+  size_t records;
+};
+
+int trace_start( struct librailcan_bus* bus , const char* path );
+void trace_stop( struct librailcan_bus* bus );
+
+/**
+ * \brief Append a record to the trace of \a bus, on a write error the trace is stopped.
+ */
+void trace_record( struct librailcan_bus* bus , bool tx , uint64_t timestamp , uint32_t id , int8_t dlc , const void* data );
+
+/**
+ * \brief Open a trace file for reading and check its header.
+ */
+int trace_open( const char* path , FILE** file );
+
+/**
+ * \brief Read the next record.
+ *
+ * \param[out] data receives up to \ref LIBRAILCAN_FD_DATA_MAX bytes
+ * \return \c 1 if a record was read, \c 0 at the end of the trace, \ref LIBRAILCAN_STATUS_UNSUCCESSFUL if the trace is truncated or corrupt.
+ */
+int trace_read( FILE* file , struct trace_record* record , uint8_t* data );
+
+#endif
@@ -0,0 +1,544 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#include "virtual.h"
+#include <stdlib.h>
+#include <string.h>
+#include "allocator.h"
+#include "../shared/railcan-proto/railcan_proto.h"
+#include "bus.h"
+#include "module_dcc_types.h"
+#include "utils.h"
+
+/**
+ * \brief Number of bits a frame occupies the bus, including worst case bit stuffing and interframe space.
+ *
+ * Payloads longer than eight bytes are timed as if sent at the nominal bit rate.
+ */
+static inline uint64_t frame_bits( int8_t dlc )
+{
+  const uint64_t n = ( dlc > 0 ) ? dlc : 0;
+
+  return 47 + 8 * n + ( 34 + 8 * n - 1 ) / 4;
+}
+
+/**
+ * \brief Time a DCC packet with checksum occupies the track.
+ */
+static uint64_t dcc_packet_time( const uint8_t* data , uint8_t length )
+{
+  uint8_t checksum = 0;
+  unsigned int ones = VIRTUAL_DCC_PREAMBLE_BITS + 1; // preamble and packet end bit
+  unsigned int zeros = length + 1; // data start bits
+
+  for( uint8_t i = 0 ; i < length ; i++ )
+  {
+    ones += __builtin_popcount( data[ i ] );
+    zeros += 8 - __builtin_popcount( data[ i ] );
+    checksum ^= data[ i ];
+  }
+
+  ones += __builtin_popcount( checksum );
+  zeros += 8 - __builtin_popcount( checksum );
+
+  return (uint64_t)ones * VIRTUAL_DCC_ONE_BIT_NS + (uint64_t)zeros * VIRTUAL_DCC_ZERO_BIT_NS;
+}
+
+static void node_send( struct virtual_bus* vb , struct virtual_node* node , uint32_t id , int8_t dlc , const void* data )
+{
+  if( node->queue.count == VIRTUAL_NODE_QUEUE_SIZE )
+  {
+    vb->stats.node_queue_overflows++;
+    return;
+  }
+
+  struct virtual_frame* frame = &node->queue.frames[ ( node->queue.front + node->queue.count ) % VIRTUAL_NODE_QUEUE_SIZE ];
+
+  frame->id = id;
+  frame->dlc = dlc;
+  if( dlc > 0 )
+    memcpy( frame->data , data , dlc );
+
+  node->queue.count++;
+}
+
+static void node_send_info( struct virtual_bus* vb , struct virtual_node* node )
+{
+  uint8_t data[ sizeof( railcan_message_info_t ) + 1 ];
+  railcan_message_info_t info;
+  size_t length = sizeof( info );
+
+  memset( &info , 0 , sizeof( info ) );
+  info.node_type = node->type;
+  if( node->type == LIBRAILCAN_MODULETYPE_IO )
+  {
+    info.io.digital_input_count = node->io.input_count;
+    info.io.digital_output_count = node->io.output_count;
+  }
+  memcpy( data , &info , sizeof( info ) );
+
+  if( node->type == LIBRAILCAN_MODULETYPE_DCC ) // advertise both reply formats
+    data[ length++ ] = ( 1 << LIBRAILCAN_DCC_REPLY_FORMAT_SINGLE ) | ( 1 << LIBRAILCAN_DCC_REPLY_FORMAT_PACKED );
+
+  node_send( vb , node , RAILCAN_SID( RAILCAN_SID_MESSAGE_INFO , node->address ) , min( length , (size_t)LIBRAILCAN_DATA_MAX ) , data );
+}
+
+static void io_received( struct librailcan_bus* bus , struct virtual_node* node , const struct virtual_frame* frame )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+  const uint8_t input_length = min( ( node->io.input_count + 7 ) / 8 , bus->frame_data_max );
+  const uint8_t output_length = min( ( node->io.output_count + 7 ) / 8 , bus->frame_data_max );
+
+  switch( RAILCAN_SID_TO_MESSAGE( frame->id ) )
+  {
+    case RAILCAN_SID_MESSAGE_INPUTS:
+      if( frame->dlc == LIBRAILCAN_DLC_RTR )
+        node_send( vb , node , RAILCAN_SID( RAILCAN_SID_MESSAGE_INPUTS , node->address ) , input_length , node->io.inputs );
+      break;
+
+    case RAILCAN_SID_MESSAGE_OUTPUTS:
+      if( frame->dlc == LIBRAILCAN_DLC_RTR )
+        node_send( vb , node , RAILCAN_SID( RAILCAN_SID_MESSAGE_OUTPUTS , node->address ) , output_length , node->io.outputs );
+      else
+      {
+        memcpy( node->io.outputs , frame->data , min( (uint8_t)frame->dlc , output_length ) );
+        vb->stats.io_output_frames++;
+      }
+      break;
+  }
+}
+
+static void io_event( struct librailcan_bus* bus , struct virtual_node* node )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+
+  // Toggle a pseudo random input:
+  node->io.random ^= node->io.random << 13;
+  node->io.random ^= node->io.random >> 17;
+  node->io.random ^= node->io.random << 5;
+
+  const unsigned int index = node->io.random % node->io.input_count;
+  node->io.inputs[ index / 8 ] ^= 1 << ( index % 8 );
+
+  node_send( vb , node , RAILCAN_SID( RAILCAN_SID_MESSAGE_INPUTS , node->address ) , min( ( node->io.input_count + 7 ) / 8 , bus->frame_data_max ) , node->io.inputs );
+
+  vb->stats.io_input_changes++;
+  node->next_event += node->io.input_change_interval;
+}
+
+static void dcc_request( struct virtual_bus* vb , struct virtual_node* node )
+{
+  node_send( vb , node , RAILCAN_SID( RAILCAN_SID_MESSAGE_DCC , node->address ) , LIBRAILCAN_DLC_RTR , NULL );
+  node->dcc.awaiting = true;
+}
+
+static bool dcc_valid( uint8_t length )
+{
+  return length >= 2 && length <= DCC_PACKET_LENGTH_MAX;
+}
+
+static void dcc_received( struct librailcan_bus* bus , struct virtual_node* node , const struct virtual_frame* frame )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+
+  if( RAILCAN_SID_TO_MESSAGE( frame->id ) != RAILCAN_SID_MESSAGE_DCC || frame->dlc <= 0 )
+    return;
+
+  // Decode the packet and put it on the track:
+  const uint64_t now = bus->virtual.now;
+  uint64_t start = ( node->dcc.line_free > now ) ? node->dcc.line_free : now;
+  uint64_t time = 0;
+  uint64_t last = 0; // start of the last packet relative to start
+
+  if( frame->dlc <= DCC_PACKET_LENGTH_MAX ) // single packet
+  {
+    if( dcc_valid( frame->dlc ) )
+    {
+      time = dcc_packet_time( frame->data , frame->dlc );
+      vb->stats.dcc_packets++;
+    }
+    else
+      vb->stats.dcc_invalid_packets++;
+  }
+  else // packed: length prefixed packets, up to a zero length or the end of the frame
+  {
+    for( int i = 0 ; i < frame->dlc && frame->data[ i ] != 0 ; i += 1 + frame->data[ i ] )
+    {
+      const uint8_t length = frame->data[ i ];
+
+      if( !dcc_valid( length ) || i + 1 + length > frame->dlc )
+      {
+        vb->stats.dcc_invalid_packets++;
+        break;
+      }
+
+      last = time;
+      time += dcc_packet_time( frame->data + i + 1 , length );
+      vb->stats.dcc_packets++;
+    }
+  }
+
+  vb->stats.dcc_line_busy_time += time;
+  node->dcc.line_free = start + time;
+  node->dcc.awaiting = false;
+
+  // The next reply is requested as soon as its last packet starts on the track:
+  node->next_event = start + last;
+}
+
+static void dcc_event( struct librailcan_bus* bus , struct virtual_node* node )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+  const uint64_t now = bus->virtual.now;
+
+  if( node->dcc.line_free <= now ) // no packet available in time, keep the track powered with an idle packet
+  {
+    static const uint8_t idle[] = { 0xff , 0x00 };
+    const uint64_t time = dcc_packet_time( idle , sizeof( idle ) );
+
+    node->dcc.line_free = now + time;
+    vb->stats.dcc_fill_packets++;
+    vb->stats.dcc_line_busy_time += time;
+
+    dcc_request( vb , node ); // the reply may be lost, ask again
+  }
+  else if( !node->dcc.awaiting )
+    dcc_request( vb , node );
+
+  node->next_event = node->dcc.line_free;
+}
+
+static void node_received( struct librailcan_bus* bus , struct virtual_node* node , const struct virtual_frame* frame )
+{
+  if( RAILCAN_SID_TO_MESSAGE( frame->id ) == RAILCAN_SID_MESSAGE_INFO )
+  {
+    if( frame->dlc == LIBRAILCAN_DLC_RTR )
+      node_send_info( bus->virtual.state , node );
+  }
+  else if( node->type == LIBRAILCAN_MODULETYPE_IO )
+    io_received( bus , node , frame );
+  else if( node->type == LIBRAILCAN_MODULETYPE_DCC )
+    dcc_received( bus , node , frame );
+}
+
+/**
+ * \brief Start sending the pending frame with the lowest identifier, like CAN arbitration does.
+ */
+static void start_transmission( struct librailcan_bus* bus )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+  const struct virtual_frame* winner = NULL;
+  struct virtual_node* winner_node = NULL;
+
+  if( vb->host_queue.count > 0 )
+    winner = &vb->host_queue.frames[ vb->host_queue.front ];
+
+  for( size_t i = 0 ; i < vb->node_count ; i++ )
+  {
+    struct virtual_node* node = vb->node_list[ i ];
+
+    if( node->queue.count > 0 && ( !winner || node->queue.frames[ node->queue.front ].id < winner->id ) )
+    {
+      winner = &node->queue.frames[ node->queue.front ];
+      winner_node = node;
+    }
+  }
+
+  if( !winner )
+    return;
+
+  vb->tx_frame = *winner;
+  vb->tx_node = winner_node;
+  vb->tx_end = bus->virtual.now + frame_bits( winner->dlc ) * vb->bit_time;
+  vb->transmitting = true;
+
+  if( winner_node )
+  {
+    winner_node->queue.front = ( winner_node->queue.front + 1 ) % VIRTUAL_NODE_QUEUE_SIZE;
+    winner_node->queue.count--;
+  }
+  else
+  {
+    vb->host_queue.front = ( vb->host_queue.front + 1 ) & ( vb->host_queue.capacity - 1 );
+    vb->host_queue.count--;
+  }
+}
+
+static void complete_transmission( struct librailcan_bus* bus )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+  const struct virtual_frame* frame = &vb->tx_frame;
+
+  vb->transmitting = false;
+  vb->stats.frames++;
+  vb->stats.bus_busy_time += frame_bits( frame->dlc ) * vb->bit_time;
+
+  if( vb->tx_node ) // node to library
+  {
+    struct librailcan_timestamp timestamp = {
+      .software = bus->virtual.now ,
+      .hardware = bus->virtual.now
+    };
+
+    vb->stats.node_frames++;
+    bus->stats.frames_received++;
+
+    bus_received( bus , frame->id , frame->dlc , frame->dlc > 0 ? frame->data : NULL , &timestamp );
+  }
+  else // library to node(s)
+  {
+    const uint8_t address = RAILCAN_SID_TO_ADDRESS( frame->id );
+
+    vb->stats.host_frames++;
+    bus->stats.frames_sent++;
+
+    if( address == RAILCAN_SID_ADDRESS_BROADCAST )
+    {
+      for( size_t i = 0 ; i < vb->node_count ; i++ )
+        node_received( bus , vb->node_list[ i ] , frame );
+    }
+    else if( vb->nodes[ address ] )
+      node_received( bus , vb->nodes[ address ] , frame );
+  }
+}
+
+int virtual_open( struct librailcan_bus* bus , uint32_t bitrate )
+{
+  struct virtual_bus* vb = allocator_calloc( 1 , sizeof( *vb ) );
+  if( !vb )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  vb->bit_time = 1000000000ULL / bitrate;
+  vb->host_queue.frames = allocator_malloc( VIRTUAL_HOST_QUEUE_SIZE * sizeof( *vb->host_queue.frames ) );
+  if( !vb->host_queue.frames )
+  {
+    allocator_free( vb );
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+  }
+  vb->host_queue.capacity = VIRTUAL_HOST_QUEUE_SIZE;
+
+  bus->virtual.state = vb;
+  bus->virtual.now = 0;
+  bus->send = virtual_send;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+void virtual_close( struct librailcan_bus* bus )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+
+  for( size_t i = 0 ; i < vb->node_count ; i++ )
+    allocator_free( vb->node_list[ i ] );
+
+  allocator_free( vb->node_list );
+  allocator_free( vb->host_queue.frames );
+  allocator_free( vb );
+}
+
+int virtual_send( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+
+  if( dlc > bus->frame_data_max )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  if( vb->host_queue.count == vb->host_queue.capacity )
+  {
+    struct virtual_frame* frames = allocator_malloc( 2 * vb->host_queue.capacity * sizeof( *frames ) );
+    if( !frames )
+      return LIBRAILCAN_STATUS_NO_MEMORY;
+
+    for( size_t i = 0 ; i < vb->host_queue.count ; i++ )
+      frames[ i ] = vb->host_queue.frames[ ( vb->host_queue.front + i ) & ( vb->host_queue.capacity - 1 ) ];
+
+    allocator_free( vb->host_queue.frames );
+    vb->host_queue.frames = frames;
+    vb->host_queue.capacity *= 2;
+    vb->host_queue.front = 0;
+  }
+
+  struct virtual_frame* frame = &vb->host_queue.frames[ ( vb->host_queue.front + vb->host_queue.count ) & ( vb->host_queue.capacity - 1 ) ];
+
+  frame->id = id & 0x7ff;
+  frame->dlc = dlc;
+  if( dlc > 0 )
+    memcpy( frame->data , data , dlc );
+
+  vb->host_queue.count++;
+
+  if( vb->host_queue.count > bus->stats.send_queue_high_water )
+    bus->stats.send_queue_high_water = vb->host_queue.count;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+static int add_node( struct librailcan_bus* bus , uint8_t address , uint8_t type , struct virtual_node** node )
+{
+  struct virtual_bus* vb = bus->virtual.state;
+
+  if( address < RAILCAN_SID_ADDRESS_FIRST || address > RAILCAN_SID_ADDRESS_LAST )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( vb->nodes[ address ] )
+    return LIBRAILCAN_STATUS_UNSUCCESSFUL;
+
+  void* p = allocator_realloc( vb->node_list , ( vb->node_count + 1 ) * sizeof( *vb->node_list ) );
+  if( !p )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+  vb->node_list = p;
+
+  *node = allocator_calloc( 1 , sizeof( **node ) );
+  if( !*node )
+    return LIBRAILCAN_STATUS_NO_MEMORY;
+
+  (*node)->type = type;
+  (*node)->address = address;
+  (*node)->next_event = UINT64_MAX;
+
+  vb->nodes[ address ] = *node;
+  vb->node_list[ vb->node_count++ ] = *node;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_bus_open_virtual( uint32_t bitrate , struct librailcan_bus** bus )
+{
+  if( bitrate == 0 || bitrate > 1000000000 || !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+
+  int r = bus_open( if_virtual , bus );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  if( ( r = virtual_open( *bus , bitrate ) ) != LIBRAILCAN_STATUS_SUCCESS )
+  {
+    allocator_free( *bus );
+    *bus = NULL;
+  }
+
+  return r;
+}
+
+int librailcan_virtual_add_io_node( struct librailcan_bus* bus , uint8_t address , uint8_t input_count , uint8_t output_count , uint32_t input_change_interval )
+{
+  if( !bus || ( input_change_interval > 0 && input_count == 0 ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_virtual )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct virtual_node* node;
+  int r = add_node( bus , address , LIBRAILCAN_MODULETYPE_IO , &node );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  node->io.input_count = input_count;
+  node->io.output_count = output_count;
+  node->io.input_change_interval = (uint64_t)input_change_interval * 1000;
+  node->io.random = 0x9e3779b9 ^ address;
+
+  if( input_change_interval > 0 )
+    node->next_event = bus->virtual.now + node->io.input_change_interval;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_virtual_add_dcc_node( struct librailcan_bus* bus , uint8_t address )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_virtual )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct virtual_node* node;
+  int r = add_node( bus , address , LIBRAILCAN_MODULETYPE_DCC , &node );
+  if( r != LIBRAILCAN_STATUS_SUCCESS )
+    return r;
+
+  node->next_event = bus->virtual.now;
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_virtual_run( struct librailcan_bus* bus , uint64_t duration )
+{
+  if( !bus )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_virtual )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct virtual_bus* vb = bus->virtual.state;
+  const uint64_t end = bus->virtual.now + duration;
+
+  for( ;; )
+  {
+    if( !vb->transmitting )
+      start_transmission( bus );
+
+    // Advance to the next event:
+    uint64_t t = end;
+
+    if( vb->transmitting && vb->tx_end < t )
+      t = vb->tx_end;
+
+    for( size_t i = 0 ; i < vb->node_count ; i++ )
+      if( vb->node_list[ i ]->next_event < t )
+        t = vb->node_list[ i ]->next_event;
+
+    if( t > bus->virtual.now )
+      bus->virtual.now = t;
+
+    if( vb->transmitting && vb->tx_end <= bus->virtual.now )
+      complete_transmission( bus );
+
+    for( size_t i = 0 ; i < vb->node_count ; i++ )
+    {
+      struct virtual_node* node = vb->node_list[ i ];
+
+      if( node->next_event > bus->virtual.now )
+        continue;
+      else if( node->type == LIBRAILCAN_MODULETYPE_IO )
+        io_event( bus , node );
+      else if( node->type == LIBRAILCAN_MODULETYPE_DCC )
+        dcc_event( bus , node );
+    }
+
+    if( bus->virtual.now >= end )
+      break;
+  }
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
+
+int librailcan_virtual_get_stats( struct librailcan_bus* bus , struct librailcan_virtual_stats* stats , size_t stats_size )
+{
+  if( !bus || !stats || stats_size < sizeof( *stats ) )
+    return LIBRAILCAN_STATUS_INVALID_PARAM;
+  else if( bus->interface != if_virtual )
+    return LIBRAILCAN_STATUS_NOT_SUPPORTED;
+
+  struct virtual_bus* vb = bus->virtual.state;
+
+  vb->stats.time = bus->virtual.now;
+
+  memcpy( stats , &vb->stats , sizeof( *stats ) );
+
+  return LIBRAILCAN_STATUS_SUCCESS;
+}
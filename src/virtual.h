@@ -0,0 +1,96 @@
+/**
+ * This file is part of the librailcan library.
+ *
+ * Copyright (C) 2015 Reinder Feenstra <reinderfeenstra@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301
+ * USA
+ */
+
+#ifndef _VIRTUAL_H_
+#define _VIRTUAL_H_
+
+#include <stdbool.h>
+#include "librailcan.h"
+
+#define VIRTUAL_NODE_QUEUE_SIZE  8 //!< Frames a virtual node can have waiting for the bus.
+#define VIRTUAL_HOST_QUEUE_SIZE  256 //!< Initial number of frames the library side can have waiting for the bus.
+
+#define VIRTUAL_DCC_ONE_BIT_NS   116000 //!< Duration of a DCC one bit (2x 58 us).
+#define VIRTUAL_DCC_ZERO_BIT_NS  200000 //!< Duration of a DCC zero bit (2x 100 us).
+#define VIRTUAL_DCC_PREAMBLE_BITS  14
+
+struct virtual_frame
+{
+  uint32_t id;
+  int8_t dlc; //!< Data length or \ref LIBRAILCAN_DLC_RTR.
+  uint8_t data[ LIBRAILCAN_FD_DATA_MAX ];
+};
+
+struct virtual_node
+{
+  uint8_t type; //!< LIBRAILCAN_MODULETYPE_*
+  uint8_t address;
+  uint64_t next_event; //!< Time of the next node event, \c UINT64_MAX if none.
+  struct
+  {
+    struct virtual_frame frames[ VIRTUAL_NODE_QUEUE_SIZE ];
+    unsigned int front;
+    unsigned int count;
+  } queue;
+  union
+  {
+    struct
+    {
+      uint8_t input_count;
+      uint8_t output_count;
+      uint8_t inputs[ 32 ];
+      uint8_t outputs[ 32 ];
+      uint64_t input_change_interval; //!< Time between generated input changes, \c 0 if disabled.
+      uint32_t random; //!< xorshift state, selects the changing input.
+    } io;
+    struct
+    {
+      uint64_t line_free; //!< Time the DCC line finishes the packets sent so far.
+      bool awaiting; //!< A request for the next packet is outstanding.
+    } dcc;
+  };
+};
+
+struct virtual_bus
+{
+  uint64_t bit_time; //!< Nanoseconds per CAN bit.
+  struct virtual_node* nodes[ 256 ]; //!< Indexed by address.
+  struct virtual_node** node_list; //!< Dense list for the event scan.
+  size_t node_count;
+  struct
+  {
+    struct virtual_frame* frames;
+    size_t capacity; //!< Always a power of two.
+    size_t front;
+    size_t count;
+  } host_queue;
+  bool transmitting;
+  uint64_t tx_end;
+  struct virtual_frame tx_frame;
+  struct virtual_node* tx_node; //!< Transmitting node, \c NULL for the library side.
+  struct librailcan_virtual_stats stats;
+};
+
+int virtual_open( struct librailcan_bus* bus , uint32_t bitrate );
+void virtual_close( struct librailcan_bus* bus );
+int virtual_send( struct librailcan_bus* bus , uint32_t id , int8_t dlc , const void* data );
+
+#endif